@@ -0,0 +1,62 @@
+/*
+ * \file    arena.c
+ * \author  Scott Wales (scott.wales@unimelb.edu.au)
+ * \brief   A fixed size memory pool for field buffers
+ * 
+ * Copyright 2013 ARC Centre of Excellence for Climate System Science
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */ 
+
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Buffers are aligned to this many bytes
+static const size_t ALIGN = 64;
+
+struct arena {
+    char * block;
+    size_t size;
+    size_t used;
+};
+
+struct arena * ArenaCreate(size_t size){
+    struct arena * this = malloc(sizeof(*this));
+    this->size = size;
+    this->used = 0;
+    this->block = NULL;
+    if (posix_memalign((void**)&this->block,ALIGN,size ? size : ALIGN) != 0){
+        perror("ArenaCreate");
+        exit(-1);
+    }
+    return this;
+}
+void * ArenaAlloc(struct arena * this, size_t size){
+    // Round up so the next buffer is aligned as well
+    size_t padded = (size + ALIGN - 1) & ~(ALIGN - 1);
+    if (size > this->size - this->used) return NULL;
+    void * buffer = this->block + this->used;
+    this->used += padded;
+    if (this->used > this->size) this->used = this->size;
+    return buffer;
+}
+void ArenaReset(struct arena * this){
+    this->used = 0;
+}
+void ArenaFree(struct arena * this){
+    if (this){
+        free(this->block);
+    }
+    free(this);
+}
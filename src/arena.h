@@ -0,0 +1,75 @@
+/**
+ * \file    arena.h
+ * \author  Scott Wales (scott.wales@unimelb.edu.au)
+ * \brief   A fixed size memory pool for field buffers
+ *
+ * The arena holds a single block of memory, allocated once when it is
+ * created. Buffers are handed out from the block in order and are all
+ * returned at once by resetting the arena, so the same memory is reused over
+ * and over rather than going back to the system for each field.
+ * 
+ * Copyright 2013 ARC Centre of Excellence for Climate System Science
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */ 
+
+#ifndef ARENA_H
+#define ARENA_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/** @defgroup arena
+ *  @{
+ */
+
+struct arena;
+
+/** 
+ * @brief Creates an arena holding \p size bytes
+ *
+ * If the memory can't be allocated the function will call perror() and
+ * exit(-1).
+ */
+struct arena * ArenaCreate(size_t size);
+
+/** 
+ * @brief Returns a buffer of \p size bytes from the arena
+ *
+ * Returns NULL if the arena doesn't have enough space left, the caller should
+ * finish with the buffers it holds and call ArenaReset() before trying again.
+ */
+void * ArenaAlloc(struct arena * arena, size_t size);
+
+/** 
+ * @brief Returns all buffers to the arena
+ *
+ * @post Buffers previously returned by ArenaAlloc() must no longer be used
+ */
+void ArenaReset(struct arena * arena);
+
+/** 
+ * @brief Frees the memory held by \p arena
+ */
+void ArenaFree(struct arena * arena);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -18,15 +18,20 @@
  * limitations under the License.
  */ 
 
+#include "arena.h"
 #include "fieldsfile.h"
 #include "list.h"
+#include "zarr.h"
 #include <argp.h>
 #include <assert.h>
 #include <netcdf.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-const char * doc = "Extracts a single STASH variable into a netcdf file";
+const char * doc = "Extracts a single STASH variable into a netcdf file or a "
+                   "Zarr directory store";
 
 const char * argp_program_version     = "0";
 const char * argp_program_bug_address = "scott.wales@unimelb.edu.au";
@@ -35,12 +40,57 @@ struct args {
     const char * filename;
     const char * output;
     int stash;
+    size_t memory_limit;
+    enum { FORMAT_NETCDF, FORMAT_ZARR } format;
+    int threads;
 };
 
+struct argp_option options[] = {
+    {"memory-limit", 'm', "SIZE", 0,
+     "Hold at most SIZE bytes of data in memory, SIZE may have a K, M or G "
+     "suffix. By default only a single field is held, or for Zarr output one "
+     "more than the number of threads"},
+    {"format", 'f', "FORMAT", 0,
+     "Output format, either 'netcdf' (the default) or 'zarr'"},
+    {"threads", 't', "N", 0,
+     "Number of threads writing Zarr chunks (default one per core). Fewer are "
+     "used if the memory limit can't hold a field for each"},
+    {0},
+};
+
+// Parse a size in bytes with an optional binary suffix
+int parse_size(const char * arg, size_t * size){
+    char * end = NULL;
+    double value = strtod(arg,&end);
+    if (end == arg || value < 0) return 0;
+    switch (*end){
+        case 'k': case 'K': value *= 1024.0; ++end; break;
+        case 'm': case 'M': value *= 1024.0*1024.0; ++end; break;
+        case 'g': case 'G': value *= 1024.0*1024.0*1024.0; ++end; break;
+    }
+    if (*end != '\0') return 0;
+    *size = value;
+    return 1;
+}
+
 const char * args_doc = "FILENAME STASHCODE OUTPUT";
 error_t parse_opt(int key, char * arg, struct argp_state * state){
     struct args * args = state->input;
     switch (key){
+        case 'm':
+            // Zero would be taken as no limit given
+            if (!parse_size(arg,&(args->memory_limit)) ||
+                args->memory_limit == 0) argp_usage(state);
+            break;
+        case 'f':
+            if (strcmp(arg,"netcdf") == 0) args->format = FORMAT_NETCDF;
+            else if (strcmp(arg,"zarr") == 0) args->format = FORMAT_ZARR;
+            else argp_usage(state);
+            break;
+        case 't':
+            if (sscanf(arg,"%d",&(args->threads)) != 1 ||
+                args->threads < 1) argp_usage(state);
+            break;
         case ARGP_KEY_ARG:
             // Unnamed argument
             switch (state->arg_num){
@@ -73,9 +123,216 @@ error_t parse_opt(int key, char * arg, struct argp_state * state){
 }
 
 
+// A variable to be written out and its dimensions
+struct variable {
+    int stash;
+    struct list * timelist;
+    struct list * heightlist;
+    struct list * pseudolist;
+    int size[2];
+
+    // Dimension values
+    double * lats;
+    double * lons;
+    double * times;
+    double * heights;
+    double * pseudos;
+};
+
+// Get the index of a field's slice in time, vertical & pseudo levels
+void slice_start(const struct variable * var, const struct FFLookup * lookup,
+                 size_t start[5]){
+    start[0] = ListIndex(var->timelist,FFDateToUnixTime(lookup->valid_time)); 
+    start[1] = ListIndex(var->heightlist,lookup->heightlevel);
+    start[2] = ListIndex(var->pseudolist,lookup->pseudo_dimension);
+    start[3] = 0;
+    start[4] = 0;
+}
+
+// A field read from the file waiting to be written out
+struct pending {
+    size_t start[5];
+    double * data;
+};
+
+// Write out all pending fields, after which their buffers can be reused
+void write_pending(int out, int varstash, const int size[2],
+                   const struct pending * pending, size_t count){
+    for (size_t p=0;p<count;++p){
+        size_t countv[] = { 1, 1, 1, size[0], size[1] };
+        int errc = nc_put_vara_double(out,varstash,pending[p].start,countv,
+                                      pending[p].data);
+        if (errc != NC_NOERR){
+            fprintf(stderr,"%s\n",nc_strerror(errc));
+            exit(-1);
+        }
+    }
+}
+
+void write_netcdf(const char * output, struct FieldsFile * ff,
+                  const struct variable * var,
+                  struct arena * pool, size_t limit){
+    const int * size = var->size;
+
+    int out; // output file handle
+    int errc = nc_create(output, NC_CLOBBER, &out);
+    assert(errc == NC_NOERR);
+
+    // Declare dimensions
+    int dimtime,dimheight,dimbin,dimlat,dimlon;
+    errc |= nc_def_dim(out,"time",ListCount(var->timelist),&dimtime);
+    errc |= nc_def_dim(out,"height",ListCount(var->heightlist),&dimheight);
+    errc |= nc_def_dim(out,"bin",ListCount(var->pseudolist),&dimbin);
+    errc |= nc_def_dim(out,"grid_latitude",size[0],&dimlat);
+    errc |= nc_def_dim(out,"grid_longitude",size[1],&dimlon);
+    assert(errc == NC_NOERR);
+
+    // Declare dimension arrays
+    int vartime,varheight,varbin,varlat,varlon;
+    errc |= nc_def_var(out,"time",NC_DOUBLE,1,&dimtime,&vartime);
+    errc |= nc_def_var(out,"height",NC_DOUBLE,1,&dimheight,&varheight);
+    errc |= nc_def_var(out,"bin",NC_DOUBLE,1,&dimbin,&varbin);
+    errc |= nc_def_var(out,"grid_latitude",NC_DOUBLE,1,&dimlat,&varlat);
+    errc |= nc_def_var(out,"grid_longitude",NC_DOUBLE,1,&dimlon,&varlon);
+    assert(errc == NC_NOERR);
+
+    // Declare data array
+    char * stashname = NULL;
+    asprintf(&stashname,"stash.%d",var->stash);
+    int dims[] = {dimtime,dimheight,dimbin,dimlat,dimlon};
+    int varstash;
+    errc = nc_def_var(out,stashname,NC_DOUBLE,5,dims,&varstash);
+    if (errc != NC_NOERR){
+        fprintf(stderr,"%s\n",nc_strerror(errc));
+        exit(-1);
+    }
+    free(stashname);
+
+    nc_enddef(out);
+
+    // Write dimension values
+    errc |= nc_put_var_double(out,vartime,var->times);
+    errc |= nc_put_var_double(out,varheight,var->heights);
+    errc |= nc_put_var_double(out,varbin,var->pseudos);
+    errc |= nc_put_var_double(out,varlat,var->lats);
+    errc |= nc_put_var_double(out,varlon,var->lons);
+    assert(errc == NC_NOERR);
+
+    // Dimensions are written, reuse the pool for data
+    ArenaReset(pool);
+
+    // Write data values layer by layer. Fields are read into the pool until it
+    // is full, then written out together before reading any more.
+    size_t fieldbytes = size[0]*size[1]*sizeof(double);
+    size_t maxpending = limit / fieldbytes;
+    struct pending * pending = malloc(maxpending*sizeof(*pending));
+    size_t npending = 0;
+    for (size_t i=0;i<ff->header->field_count;++i){
+        if (ff->lookup[i].stash_code == var->stash){
+            double * data = NULL;
+            if (npending < maxpending) data = ArenaAlloc(pool,fieldbytes);
+            if (!data){
+                // Pool is full, write out what is held before reading more
+                write_pending(out,varstash,size,pending,npending);
+                npending = 0;
+                ArenaReset(pool);
+                data = ArenaAlloc(pool,fieldbytes);
+            }
+
+            // Hyperslice of the field at a single horizontal level
+            struct pending * p = &pending[npending++];
+            slice_start(var,&ff->lookup[i],p->start);
+            p->data = data;
+
+            // Read the layer from the fieldsfile
+            ReadFieldsFileDataBuffer(data,ff,i);
+        }
+    }
+    write_pending(out,varstash,size,pending,npending);
+
+    nc_close(out);
+
+    free(pending);
+}
+
+// Write a coordinate variable as a single chunk
+void write_zarr_coordinate(const char * output, const char * name,
+                           const double * values, size_t count){
+    size_t chunk = 0;
+    const char * dims[] = { name };
+    struct zarr * array = ZarrCreate(output,name,1,&count,&count,dims);
+    ZarrWriteChunk(array,&chunk,values);
+    ZarrFree(array);
+}
+
+void write_zarr(const char * output, struct FieldsFile * ff,
+                const struct variable * var,
+                struct arena * pool, int threads){
+    const int * size = var->size;
+
+    // A store may hold several variables with different coordinates, so each
+    // variable gets its own, e.g. 'time_16' for 'stash.16'
+    const char * names[] = {"time","height","bin","grid_latitude","grid_longitude"};
+    char * dims[5];
+    for (int d=0;d<5;++d) asprintf(&dims[d],"%s_%d",names[d],var->stash);
+
+    // Coordinates are written first, so the store can be opened while the
+    // data is still being written
+    write_zarr_coordinate(output,dims[0],var->times,ListCount(var->timelist));
+    write_zarr_coordinate(output,dims[1],var->heights,ListCount(var->heightlist));
+    write_zarr_coordinate(output,dims[2],var->pseudos,ListCount(var->pseudolist));
+    write_zarr_coordinate(output,dims[3],var->lats,size[0]);
+    write_zarr_coordinate(output,dims[4],var->lons,size[1]);
+
+    // Each field is a single chunk
+    char * stashname = NULL;
+    asprintf(&stashname,"stash.%d",var->stash);
+    size_t shape[] = {
+        ListCount(var->timelist),
+        ListCount(var->heightlist),
+        ListCount(var->pseudolist),
+        size[0],
+        size[1]
+    };
+    size_t chunks[] = { 1, 1, 1, size[0], size[1] };
+    struct zarr * array = ZarrCreate(output,stashname,5,shape,chunks,
+                                     (const char * const *)dims);
+    free(stashname);
+    for (int d=0;d<5;++d) free(dims[d]);
+
+    // Dimensions are written, fill the pool with field buffers for the
+    // writer threads. Reading waits for a free buffer once they are all in use.
+    ArenaReset(pool);
+    size_t fieldbytes = size[0]*size[1]*sizeof(double);
+    size_t nbuffers = 0;
+    double ** buffers = NULL;
+    double * buffer;
+    while ((buffer = ArenaAlloc(pool,fieldbytes))){
+        buffers = realloc(buffers,(nbuffers+1)*sizeof(*buffers));
+        buffers[nbuffers++] = buffer;
+    }
+    struct zarrwriter * writer = ZarrWriterStart(array,threads,buffers,nbuffers);
+
+    for (size_t i=0;i<ff->header->field_count;++i){
+        if (ff->lookup[i].stash_code == var->stash){
+            size_t start[5];
+            slice_start(var,&ff->lookup[i],start);
+
+            double * data = ZarrWriterBuffer(writer);
+            ReadFieldsFileDataBuffer(data,ff,i);
+            ZarrWriterSubmit(writer,data,start);
+        }
+    }
+
+    ZarrWriterFinish(writer);
+    ZarrFree(array);
+    free(buffers);
+}
+
 int main(int argc, char ** argv){
-    struct args args;
+    struct args args = {0};
     struct argp argp = {
+        .options = options,
         .doc = doc,
         .args_doc = args_doc,
         .parser = parse_opt,
@@ -95,8 +352,12 @@ int main(int argc, char ** argv){
 
     // Get the dimensions of the field
     size_t found = 0;
+    int grid_varies = 0;
     for (size_t i=0;i<ff->header->field_count;++i){
         if (ff->lookup[i].stash_code == args.stash){
+            if (found && (size[0] != ff->lookup[i].rows ||
+                          size[1] != ff->lookup[i].columns)) grid_varies = 1;
+
             // Each value will only be added once
             ListAdd(&timelist,FFDateToUnixTime(ff->lookup[i].valid_time)); 
             ListAdd(&heightlist,ff->lookup[i].heightlevel);
@@ -117,93 +378,94 @@ int main(int argc, char ** argv){
         fprintf(stderr, "STASH %d not present in file\n",args.stash);
         exit(1);
     }
+    // Every field is written into the same horizontal grid, and buffers are
+    // sized to match it
+    if (grid_varies){
+        fprintf(stderr, "STASH %d has fields on different grids\n",args.stash);
+        exit(1);
+    }
+    if (size[0] <= 0 || size[1] <= 0){
+        fprintf(stderr, "STASH %d has an empty grid\n",args.stash);
+        exit(1);
+    }
 
-    // Now to write the field out as Netcdf. Firstly we need to write out the
+    // Now to write the field out. Firstly we need to write out the
     // dimensions. At the moment metadata is ignored, units &c will need to be
     // added elsewhere. The fieldsfile format also allows for alternate grid
     // types, we assume a regular grid here.
 
-    // Set the dimension values
-    double * lats = malloc(size[0]*sizeof(*lats));
-    double * lons = malloc(size[1]*sizeof(*lats));
-    double * times = NULL;
-    double * heights = NULL;
-    double * pseudos = NULL;
-
-    for (int i=0;i<size[0];++i) lats[i] = origin[0]+step[0]*(i+1);
-    for (int i=0;i<size[1];++i) lons[i] = origin[1]+step[1]*(i+1);
-    ListToArray(&times,timelist);
-    ListToArray(&heights,heightlist);
-    ListToArray(&pseudos,pseudolist);
-
-    int out; // output file handle
-    int errc = nc_create(args.output, NC_CLOBBER, &out);
-    assert(errc == NC_NOERR);
-
-    // Declare dimensions
-    int dimtime,dimheight,dimbin,dimlat,dimlon;
-    errc |= nc_def_dim(out,"time",ListCount(timelist),&dimtime);
-    errc |= nc_def_dim(out,"height",ListCount(heightlist),&dimheight);
-    errc |= nc_def_dim(out,"bin",ListCount(pseudolist),&dimbin);
-    errc |= nc_def_dim(out,"grid_latitude",size[0],&dimlat);
-    errc |= nc_def_dim(out,"grid_longitude",size[1],&dimlon);
-    assert(errc == NC_NOERR);
-
-    // Declare dimension arrays
-    int vartime,varheight,varbin,varlat,varlon;
-    errc |= nc_def_var(out,"time",NC_DOUBLE,1,&dimtime,&vartime);
-    errc |= nc_def_var(out,"height",NC_DOUBLE,1,&dimheight,&varheight);
-    errc |= nc_def_var(out,"bin",NC_DOUBLE,1,&dimbin,&varbin);
-    errc |= nc_def_var(out,"grid_latitude",NC_DOUBLE,1,&dimlat,&varlat);
-    errc |= nc_def_var(out,"grid_longitude",NC_DOUBLE,1,&dimlon,&varlon);
-    assert(errc == NC_NOERR);
-
-    // Declare data array
-    char * stashname = NULL;
-    asprintf(&stashname,"stash.%d",args.stash);
-    int dims[] = {dimtime,dimheight,dimbin,dimlat,dimlon};
-    int varstash;
-    errc = nc_def_var(out,stashname,NC_DOUBLE,5,dims,&varstash);
-    if (errc != NC_NOERR){
-        fprintf(stderr,"%s\n",nc_strerror(errc));
-        exit(-1);
+    // All buffers come from a single pool, first holding the dimension values
+    // then reused for the field data, so that memory use is fixed up front
+    size_t fieldbytes = size[0]*size[1]*sizeof(double);
+    size_t dimbytes = (size[0] + size[1] + ListCount(timelist) +
+                       ListCount(heightlist) + ListCount(pseudolist)) *
+                      sizeof(double) + 5*64;
+    size_t limit = args.memory_limit;
+    size_t needed = fieldbytes > dimbytes ? fieldbytes : dimbytes;
+    int threads = args.threads ? args.threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (args.format == FORMAT_ZARR){
+        // Each writer thread needs a field buffer (allowing for alignment in
+        // the pool) and compression memory outside the pool. One more buffer
+        // lets the next field be read while every thread is busy.
+        size_t thread_bytes = fieldbytes + 64 + ZARR_WRITE_MEMORY;
+        size_t read_bytes = fieldbytes + 64;
+        needed += ZARR_WRITE_MEMORY;
+        if (!limit){
+            limit = threads*thread_bytes + read_bytes;
+        } else if (limit < threads*thread_bytes + read_bytes){
+            int fit = limit > read_bytes ? (limit - read_bytes)/thread_bytes : 0;
+            if (fit < 1) fit = 1;
+            if (args.threads && fit < threads){
+                fprintf(stderr,"Memory limit of %zu bytes only allows %d "
+                               "writer threads\n",limit,fit);
+            }
+            threads = fit;
+        }
+        if (args.memory_limit && limit < needed){
+            fprintf(stderr,"Memory limit of %zu bytes is too small, at least "
+                           "%zu bytes are needed\n",limit,needed);
+            exit(1);
+        }
+        // Leave out the writer threads' compression memory
+        limit -= threads*ZARR_WRITE_MEMORY;
+    } else if (!limit){
+        limit = fieldbytes;
     }
-    free(stashname);
-
-    nc_enddef(out);
+    if (!args.memory_limit && limit < dimbytes) limit = dimbytes;
+    if (limit < fieldbytes || limit < dimbytes){
+        fprintf(stderr,"Memory limit of %zu bytes is too small, at least %zu "
+                       "bytes are needed\n",args.memory_limit,needed);
+        exit(1);
+    }
+    struct arena * pool = ArenaCreate(limit);
 
-    // Write dimension values
-    errc |= nc_put_var_double(out,vartime,times);
-    errc |= nc_put_var_double(out,varheight,heights);
-    errc |= nc_put_var_double(out,varbin,pseudos);
-    errc |= nc_put_var_double(out,varlat,lats);
-    errc |= nc_put_var_double(out,varlon,lons);
-    assert(errc == NC_NOERR);
+    // Set the dimension values
+    struct variable var = {
+        .stash = args.stash,
+        .timelist = timelist,
+        .heightlist = heightlist,
+        .pseudolist = pseudolist,
+        .size = { size[0], size[1] },
+        .lats = ArenaAlloc(pool,size[0]*sizeof(double)),
+        .lons = ArenaAlloc(pool,size[1]*sizeof(double)),
+        .times = ArenaAlloc(pool,ListCount(timelist)*sizeof(double)),
+        .heights = ArenaAlloc(pool,ListCount(heightlist)*sizeof(double)),
+        .pseudos = ArenaAlloc(pool,ListCount(pseudolist)*sizeof(double)),
+    };
 
-    // Write data values layer by layer
-    double * data = NULL;
-    for (size_t i=0;i<ff->header->field_count;++i){
-        if (ff->lookup[i].stash_code == args.stash){
-            // Get the index of this slice in time & vertical level
-            int timei = ListIndex(timelist,FFDateToUnixTime(ff->lookup[i].valid_time)); 
-            int heighti = ListIndex(heightlist,ff->lookup[i].heightlevel);
-            int bini = ListIndex(pseudolist,ff->lookup[i].pseudo_dimension);
+    for (int i=0;i<size[0];++i) var.lats[i] = origin[0]+step[0]*(i+1);
+    for (int i=0;i<size[1];++i) var.lons[i] = origin[1]+step[1]*(i+1);
+    ListToBuffer(var.times,timelist);
+    ListToBuffer(var.heights,heightlist);
+    ListToBuffer(var.pseudos,pseudolist);
 
-            // Hyperslice of the field at a single horizontal level
-            size_t start[] = { timei, heighti, bini, 0, 0 };
-            size_t count[] = { 1, 1, 1, size[0], size[1] };
-
-            // Read the layer from the fieldsfile, write to netcdf
-            ReadFieldsFileData(&data,ff,i);
-            errc = nc_put_vara_double(out,varstash,start,count,data);
-            if (errc != NC_NOERR){
-                fprintf(stderr,"%s\n",nc_strerror(errc));
-                exit(-1);
-            }
-        }
-    }
+    if (args.format == FORMAT_ZARR) write_zarr(args.output,ff,&var,pool,threads);
+    else write_netcdf(args.output,ff,&var,pool,limit);
 
-    nc_close(out);
+    ArenaFree(pool);
+    ListFree(timelist);
+    ListFree(heightlist);
+    ListFree(pseudolist);
 
     CloseFieldsFile(ff);
 }
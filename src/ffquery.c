@@ -0,0 +1,129 @@
+/*
+ * \file    ffquery.c
+ * \author  Scott Wales (scott.wales@unimelb.edu.au)
+ * \brief   Send a query to the ffserve daemon
+ *
+ * Copyright 2013 ARC Centre of Excellence for Climate System Science
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "query.h"
+#include <argp.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+const char * doc = "Sends a query to a running ffserve daemon and prints the "
+                   "reply. Commands are:\n"
+                   "  describe FILE STASH\n"
+                   "  slice FILE STASH N\n"
+                   "  series FILE STASH ROW COLUMN";
+
+const char * argp_program_version     = "0";
+const char * argp_program_bug_address = "scott.wales@unimelb.edu.au";
+
+struct args {
+    char socket[PATH_MAX];
+    char request[QUERY_MAX_REQUEST];
+};
+
+struct argp_option options[] = {
+    {"socket", 'S', "PATH", 0, "Connect to PATH instead of the default socket"},
+    {0},
+};
+
+const char * args_doc = "COMMAND FILE STASH [ARGS...]";
+error_t parse_opt(int key, char * arg, struct argp_state * state){
+    struct args * args = state->input;
+    switch (key){
+        case 'S':
+            snprintf(args->socket,sizeof(args->socket),"%s",arg);
+            break;
+        case ARGP_KEY_ARG:
+            {
+                // The daemon resolves paths itself, so make them absolute
+                char * path = NULL;
+                if (state->arg_num == 1) path = realpath(arg,NULL);
+
+                size_t length = strlen(args->request);
+                snprintf(args->request+length,sizeof(args->request)-length,
+                         "%s%s",length ? " " : "",path ? path : arg);
+                free(path);
+                break;
+            }
+        case ARGP_KEY_END:
+            // End of arguments
+            if (state->arg_num < 3) argp_usage(state);
+            break;
+        default:
+            // Unknown argument
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv){
+    struct args args = {{0}};
+    QueryDefaultSocket(args.socket,sizeof(args.socket));
+    struct argp argp = {
+        .options = options,
+        .doc = doc,
+        .args_doc = args_doc,
+        .parser = parse_opt,
+    };
+    error_t err = argp_parse(&argp, argc, argv, 0, NULL, &args);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path,sizeof(addr.sun_path),"%s",args.socket);
+
+    int sock = socket(AF_UNIX,SOCK_STREAM,0);
+    if (sock < 0 || connect(sock,(struct sockaddr *)&addr,sizeof(addr)) != 0){
+        perror(args.socket);
+        exit(-1);
+    }
+
+    strcat(args.request,"\n");
+    size_t length = strlen(args.request);
+    if (write(sock,args.request,length) != length){
+        perror("write");
+        exit(-1);
+    }
+    shutdown(sock,SHUT_WR);
+
+    // Copy the reply to stdout, or stderr if the request failed
+    char buffer[65536];
+    size_t total = 0;
+    FILE * out = stdout;
+    ssize_t n;
+    while ((n = read(sock,buffer,sizeof(buffer))) > 0){
+        if (total == 0 && n >= strlen(QUERY_ERROR) &&
+            strncmp(buffer,QUERY_ERROR,strlen(QUERY_ERROR)) == 0){
+            out = stderr;
+        }
+        fwrite(buffer,1,n,out);
+        total += n;
+    }
+    close(sock);
+
+    // The daemon always replies, so nothing means it failed
+    if (total == 0){
+        fprintf(stderr,"%s: no reply from ffserve\n",args.socket);
+        return 1;
+    }
+    return out == stderr;
+}
@@ -0,0 +1,670 @@
+/*
+ * \file    ffserve.c
+ * \author  Scott Wales (scott.wales@unimelb.edu.au)
+ * \brief   Daemon answering queries on UM files over a Unix socket
+ *
+ * Opened files, their indexes and recently read fields are kept in memory
+ * between requests, so repeated queries on the same files don't pay for
+ * opening the file and scanning the lookup table each time. See query.h for
+ * the protocol.
+ *
+ * Copyright 2013 ARC Centre of Excellence for Climate System Science
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fieldsfile.h"
+#include "query.h"
+#include <argp.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+const char * doc = "Serves queries on UM files over a Unix domain socket, "
+                   "keeping opened files and recently read fields in memory";
+
+// Seconds to wait on a client before giving up on it
+#define CLIENT_TIMEOUT 30
+
+const char * argp_program_version     = "0";
+const char * argp_program_bug_address = "scott.wales@unimelb.edu.au";
+
+struct args {
+    char socket[PATH_MAX];
+    int max_files;
+    size_t cache_memory;
+};
+
+struct argp_option options[] = {
+    {"socket",       'S', "PATH", 0, "Listen on PATH instead of the default socket"},
+    {"max-files",    'f', "N",    0, "Keep at most N files open (default 16)"},
+    {"cache-memory", 'm', "MB", 0, "Keep at most MB megabytes of field data in "
+                                   "memory (default 1024)"},
+    {0},
+};
+
+error_t parse_opt(int key, char * arg, struct argp_state * state){
+    struct args * args = state->input;
+    switch (key){
+        case 'S':
+            snprintf(args->socket,sizeof(args->socket),"%s",arg);
+            break;
+        case 'f':
+            if (sscanf(arg,"%d",&(args->max_files)) != 1 ||
+                args->max_files < 1) argp_usage(state);
+            break;
+        case 'm':
+            if (sscanf(arg,"%zu",&(args->cache_memory)) != 1 ||
+                args->cache_memory < 1) argp_usage(state);
+            break;
+        case ARGP_KEY_ARG:
+            argp_usage(state);
+            break;
+        default:
+            // Unknown argument
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+// An open file. Reads from the stream must hold lock, the rest is read only
+// once the file is in the cache. The file's identity is kept so that a file
+// replaced or modified on disk is noticed and opened again.
+struct cachedfile {
+    char * path;
+    struct FieldsFile * ff;
+    int * index;
+    pthread_mutex_t lock;
+
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+
+    // Stale files have been removed from the cache, and are freed once the
+    // last request using them is done
+    int stale;
+    int refs;
+    struct cachedfile * prev;
+    struct cachedfile * next;
+};
+
+// Data of a single field
+struct cachedfield {
+    struct cachedfile * file;
+    int field;
+    double * data;
+    size_t bytes;
+
+    int refs;
+    struct cachedfield * prev;
+    struct cachedfield * next;
+};
+
+// Both caches are doubly linked lists, most recently used first. A cached
+// field holds a reference to its file. Entries are only freed once nothing
+// refers to them. The field cache is limited by the size of the field data.
+struct cache {
+    pthread_mutex_t lock;
+    int max_files;
+    size_t max_field_bytes;
+    int nfiles;
+    size_t field_bytes;
+    struct cachedfile * files;
+    struct cachedfield * fields;
+};
+
+struct cache cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define LIST_UNLINK(head,entry) do { \
+    if ((entry)->prev) (entry)->prev->next = (entry)->next; \
+    else (head) = (entry)->next; \
+    if ((entry)->next) (entry)->next->prev = (entry)->prev; \
+    (entry)->prev = (entry)->next = NULL; \
+} while (0)
+
+#define LIST_PUSH(head,entry) do { \
+    (entry)->prev = NULL; \
+    (entry)->next = (head); \
+    if (head) (head)->prev = (entry); \
+    (head) = (entry); \
+} while (0)
+
+// Order of the stash index, by stash code then valid time, height & pseudo
+// level
+int compare_field(const void * a, const void * b, void * lookup){
+    const struct FFLookup * x = (const struct FFLookup *)lookup + *(const int *)a;
+    const struct FFLookup * y = (const struct FFLookup *)lookup + *(const int *)b;
+    if (x->stash_code != y->stash_code)
+        return (x->stash_code > y->stash_code) - (x->stash_code < y->stash_code);
+    int time = FFDateCompare(x->valid_time,y->valid_time);
+    if (time != 0) return time;
+    if (x->heightlevel != y->heightlevel)
+        return (x->heightlevel > y->heightlevel) - (x->heightlevel < y->heightlevel);
+    if (x->pseudo_dimension != y->pseudo_dimension)
+        return (x->pseudo_dimension > y->pseudo_dimension) -
+               (x->pseudo_dimension < y->pseudo_dimension);
+    return (*(const int *)a > *(const int *)b) - (*(const int *)a < *(const int *)b);
+}
+
+// Find the range [*begin, *end) of the index holding stash
+void FindStash(const struct cachedfile * file, int64_t stash,
+               size_t * begin, size_t * end){
+    const struct FFLookup * lookup = file->ff->lookup;
+    size_t lo = 0;
+    size_t hi = file->ff->header->field_count;
+    while (lo < hi){
+        size_t mid = lo + (hi-lo)/2;
+        if (lookup[file->index[mid]].stash_code < stash) lo = mid+1;
+        else hi = mid;
+    }
+    *begin = lo;
+    hi = file->ff->header->field_count;
+    while (lo < hi){
+        size_t mid = lo + (hi-lo)/2;
+        if (lookup[file->index[mid]].stash_code <= stash) lo = mid+1;
+        else hi = mid;
+    }
+    *end = lo;
+}
+
+void FreeFile(struct cachedfile * file){
+    if (file->ff) CloseFieldsFile(file->ff);
+    pthread_mutex_destroy(&file->lock);
+    free(file->index);
+    free(file->path);
+    free(file);
+}
+
+// Drop a reference to a file, freeing it if it is stale and unused.
+// Must hold cache.lock.
+void UnrefFileLocked(struct cachedfile * file){
+    file->refs--;
+    if (file->stale && file->refs == 0) FreeFile(file);
+}
+
+// Must hold cache.lock
+void DropFieldLocked(struct cachedfield * field){
+    LIST_UNLINK(cache.fields,field);
+    cache.field_bytes -= field->bytes;
+    UnrefFileLocked(field->file);
+    free(field->data);
+    free(field);
+}
+
+// Remove a file that has changed on disk from the cache. Requests already
+// using it keep their reference. Must hold cache.lock.
+void MarkStaleLocked(struct cachedfile * file){
+    LIST_UNLINK(cache.files,file);
+    cache.nfiles--;
+    file->stale = 1;
+    if (file->refs == 0) FreeFile(file);
+}
+
+// Drop unused entries from the end of the lists until they fit, and unused
+// fields of stale files. Must hold cache.lock.
+void EvictLocked(void){
+    struct cachedfield * field = cache.fields;
+    while (field){
+        struct cachedfield * next = field->next;
+        if (field->refs == 0 && field->file->stale) DropFieldLocked(field);
+        field = next;
+    }
+
+    field = cache.fields;
+    while (field && field->next) field = field->next;
+    while (field && cache.field_bytes > cache.max_field_bytes){
+        struct cachedfield * prev = field->prev;
+        if (field->refs == 0) DropFieldLocked(field);
+        field = prev;
+    }
+
+    struct cachedfile * file = cache.files;
+    while (file && file->next) file = file->next;
+    while (file && cache.nfiles > cache.max_files){
+        struct cachedfile * prev = file->prev;
+        if (file->refs > 0){
+            // Fields of the file may be holding it open
+            struct cachedfield * f = cache.fields;
+            while (f){
+                struct cachedfield * next = f->next;
+                if (f->file == file && f->refs == 0) DropFieldLocked(f);
+                f = next;
+            }
+        }
+        if (file->refs == 0){
+            LIST_UNLINK(cache.files,file);
+            cache.nfiles--;
+            FreeFile(file);
+        }
+        file = prev;
+    }
+}
+
+// Is the cached file the one described by st
+int SameFile(const struct cachedfile * file, const struct stat * st){
+    return file->dev == st->st_dev &&
+           file->ino == st->st_ino &&
+           file->size == st->st_size &&
+           file->mtime.tv_sec == st->st_mtim.tv_sec &&
+           file->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Get an open file, opening it if it isn't cached or has changed since it
+// was cached. Returns NULL and sets *error if it couldn't be opened.
+struct cachedfile * AcquireFile(const char * filename, const char ** error){
+    char * path = realpath(filename,NULL);
+    if (!path){
+        *error = "cannot open file";
+        return NULL;
+    }
+    struct stat st;
+    if (stat(path,&st) != 0 || !S_ISREG(st.st_mode)){
+        *error = "not a UM file";
+        free(path);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    for (struct cachedfile * f = cache.files; f; f = f->next){
+        if (strcmp(f->path,path) == 0){
+            if (!SameFile(f,&st)){
+                MarkStaleLocked(f);
+                EvictLocked();
+                break;
+            }
+            f->refs++;
+            LIST_UNLINK(cache.files,f);
+            LIST_PUSH(cache.files,f);
+            pthread_mutex_unlock(&cache.lock);
+            free(path);
+            return f;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    // Open and index the file without holding up other requests
+    struct cachedfile * file = calloc(1,sizeof(*file));
+    file->path = path;
+    pthread_mutex_init(&file->lock,NULL);
+    file->ff = OpenFieldsFileChecked(path,error);
+    // Identify the file actually opened, it may have changed since the stat
+    if (!file->ff || fstat(fileno(file->ff->stream),&st) != 0){
+        if (file->ff) *error = "cannot open file";
+        FreeFile(file);
+        return NULL;
+    }
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    file->mtime = st.st_mtim;
+    file->size = st.st_size;
+
+    size_t count = file->ff->header->field_count;
+    file->index = malloc(count*sizeof(*(file->index)));
+    for (size_t i=0;i<count;++i) file->index[i] = i;
+    qsort_r(file->index,count,sizeof(*(file->index)),compare_field,
+            file->ff->lookup);
+    file->refs = 1;
+
+    pthread_mutex_lock(&cache.lock);
+    for (struct cachedfile * f = cache.files; f; f = f->next){
+        if (strcmp(f->path,path) == 0){
+            if (SameFile(f,&st)){
+                // Another request got there first
+                f->refs++;
+                pthread_mutex_unlock(&cache.lock);
+                FreeFile(file);
+                return f;
+            }
+            MarkStaleLocked(f);
+            break;
+        }
+    }
+    LIST_PUSH(cache.files,file);
+    cache.nfiles++;
+    EvictLocked();
+    pthread_mutex_unlock(&cache.lock);
+    return file;
+}
+
+// Check the field can be decoded, rather than exiting in ReadFieldsFileData()
+int CanRead(struct cachedfile * file, int field){
+    pthread_mutex_lock(&file->lock);
+    int ok = CanReadFieldsFileData(file->ff,field);
+    pthread_mutex_unlock(&file->lock);
+    return ok;
+}
+
+void ReleaseFile(struct cachedfile * file){
+    pthread_mutex_lock(&cache.lock);
+    UnrefFileLocked(file);
+    EvictLocked();
+    pthread_mutex_unlock(&cache.lock);
+}
+
+// Get the data of a field, reading it if it isn't cached. Returns NULL and
+// sets *error if it couldn't be read.
+struct cachedfield * AcquireField(struct cachedfile * file, int field,
+                                  const char ** error){
+    pthread_mutex_lock(&cache.lock);
+    for (struct cachedfield * f = cache.fields; f; f = f->next){
+        if (f->file == file && f->field == field){
+            f->refs++;
+            LIST_UNLINK(cache.fields,f);
+            LIST_PUSH(cache.fields,f);
+            pthread_mutex_unlock(&cache.lock);
+            return f;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    // Check the size against the file before trusting it with an allocation,
+    // every value takes at least 32 bits in the file
+    const struct FFLookup * lookup = &file->ff->lookup[field];
+    if (lookup->rows <= 0 || lookup->columns <= 0 ||
+        lookup->rows > file->size/lookup->columns/(off_t)sizeof(float)){
+        *error = "field size is invalid";
+        return NULL;
+    }
+
+    struct cachedfield * new = calloc(1,sizeof(*new));
+    new->file = file;
+    new->field = field;
+    new->refs = 1;
+    new->bytes = lookup->rows*lookup->columns*sizeof(*(new->data));
+    new->data = malloc(new->bytes);
+    pthread_mutex_lock(&file->lock);
+    int err = ReadFieldsFileDataChecked(new->data,file->ff,field);
+    pthread_mutex_unlock(&file->lock);
+    if (err != 0){
+        *error = "cannot read field";
+        free(new->data);
+        free(new);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    for (struct cachedfield * f = cache.fields; f; f = f->next){
+        if (f->file == file && f->field == field){
+            // Another request got there first
+            f->refs++;
+            pthread_mutex_unlock(&cache.lock);
+            free(new->data);
+            free(new);
+            return f;
+        }
+    }
+    file->refs++;
+    LIST_PUSH(cache.fields,new);
+    cache.field_bytes += new->bytes;
+    EvictLocked();
+    pthread_mutex_unlock(&cache.lock);
+    return new;
+}
+
+void ReleaseField(struct cachedfield * field){
+    pthread_mutex_lock(&cache.lock);
+    field->refs--;
+    EvictLocked();
+    pthread_mutex_unlock(&cache.lock);
+}
+
+void print_date(FILE * out, const struct FFDate * date){
+    char buffer[64];
+    FFDateToString(buffer,sizeof(buffer),*date);
+    fputs(buffer,out);
+}
+
+const char * Describe(FILE * out, struct cachedfile * file, int64_t stash){
+    size_t begin, end;
+    FindStash(file,stash,&begin,&end);
+    if (begin == end) return "stash not present in file";
+
+    for (size_t n=begin;n<end;++n){
+        const struct FFLookup * lookup = &file->ff->lookup[file->index[n]];
+        fprintf(out,"%zu\t",n-begin);
+        print_date(out,&lookup->valid_time);
+        fprintf(out,"\t%e\t%lld\t%lldx%lld\n",
+                lookup->heightlevel,
+                lookup->pseudo_dimension,
+                lookup->rows,
+                lookup->columns);
+    }
+    return NULL;
+}
+
+const char * Slice(FILE * out, struct cachedfile * file, int64_t stash,
+                   long n){
+    size_t begin, end;
+    FindStash(file,stash,&begin,&end);
+    if (begin == end) return "stash not present in file";
+    if (n < 0 || n >= end-begin) return "field number out of range";
+
+    int i = file->index[begin+n];
+    if (!CanRead(file,i)) return "field packing not supported";
+    const struct FFLookup * lookup = &file->ff->lookup[i];
+    const char * error = NULL;
+    struct cachedfield * field = AcquireField(file,i,&error);
+    if (!field) return error;
+    for (int64_t r=0;r<lookup->rows;++r){
+        for (int64_t c=0;c<lookup->columns;++c){
+            fprintf(out,"%s%.9g",c ? " " : "",
+                    field->data[r*lookup->columns+c]);
+        }
+        fprintf(out,"\n");
+    }
+    ReleaseField(field);
+    return NULL;
+}
+
+// Read a single point of a field. Points of uncompressed fields are read
+// straight from the file without caching, so that a long series doesn't push
+// every other field out of the cache. Compressed fields are decoded whole.
+const char * ReadPoint(struct cachedfile * file, int i, size_t point,
+                       double * value){
+    const struct FFLookup * lookup = &file->ff->lookup[i];
+    if ((lookup->packing / 10) % 10 == FF_COMPRESS_NONE){
+        pthread_mutex_lock(&file->lock);
+        int err = ReadFieldsFileValueChecked(value,file->ff,i,point);
+        pthread_mutex_unlock(&file->lock);
+        return err ? "cannot read field" : NULL;
+    }
+
+    const char * error = NULL;
+    struct cachedfield * field = AcquireField(file,i,&error);
+    if (!field) return error;
+    *value = field->data[point];
+    ReleaseField(field);
+    return NULL;
+}
+
+const char * Series(FILE * out, struct cachedfile * file, int64_t stash,
+                    long row, long column){
+    size_t begin, end;
+    FindStash(file,stash,&begin,&end);
+    if (begin == end) return "stash not present in file";
+
+    for (size_t n=begin;n<end;++n){
+        int i = file->index[n];
+        const struct FFLookup * lookup = &file->ff->lookup[i];
+        if (row < 0 || row >= lookup->rows ||
+            column < 0 || column >= lookup->columns){
+            return "point out of range";
+        }
+        if (!CanRead(file,i)) return "field packing not supported";
+    }
+    for (size_t n=begin;n<end;++n){
+        int i = file->index[n];
+        const struct FFLookup * lookup = &file->ff->lookup[i];
+        double value;
+        const char * error = ReadPoint(file,i,row*lookup->columns+column,&value);
+        if (error) return error;
+        print_date(out,&lookup->valid_time);
+        fprintf(out,"\t%e\t%lld\t%.9g\n",
+                lookup->heightlevel,
+                lookup->pseudo_dimension,
+                value);
+    }
+    return NULL;
+}
+
+// Parse and answer a single request line
+const char * HandleRequest(FILE * out, char * request){
+    char * save = NULL;
+    char * argv[6];
+    int argc = 0;
+    for (char * tok = strtok_r(request," \t\r\n",&save);
+         tok && argc < 6;
+         tok = strtok_r(NULL," \t\r\n",&save)){
+        argv[argc++] = tok;
+    }
+    if (argc < 3) return "usage: COMMAND FILE STASH [ARGS...]";
+
+    long long stash;
+    if (sscanf(argv[2],"%lld",&stash) != 1) return "bad stash code";
+
+    long a = 0;
+    long b = 0;
+    if (strcmp(argv[0],"describe") == 0){
+        if (argc != 3) return "usage: describe FILE STASH";
+    } else if (strcmp(argv[0],"slice") == 0){
+        if (argc != 4 || sscanf(argv[3],"%ld",&a) != 1)
+            return "usage: slice FILE STASH N";
+    } else if (strcmp(argv[0],"series") == 0){
+        if (argc != 5 || sscanf(argv[3],"%ld",&a) != 1 ||
+            sscanf(argv[4],"%ld",&b) != 1)
+            return "usage: series FILE STASH ROW COLUMN";
+    } else {
+        return "unknown command";
+    }
+
+    const char * error = NULL;
+    struct cachedfile * file = AcquireFile(argv[1],&error);
+    if (!file) return error;
+
+    if (argv[0][0] == 'd') error = Describe(out,file,stash);
+    else if (argv[0][1] == 'l') error = Slice(out,file,stash,a);
+    else error = Series(out,file,stash,a,b);
+
+    ReleaseFile(file);
+    return error;
+}
+
+void * serve(void * arg){
+    int fd = (int)(intptr_t)arg;
+
+    char request[QUERY_MAX_REQUEST];
+    size_t length = 0;
+    while (length < sizeof(request)-1){
+        ssize_t n = read(fd,request+length,sizeof(request)-1-length);
+        if (n < 0){
+            // Timed out, the client isn't going to finish its request
+            close(fd);
+            return NULL;
+        }
+        if (n == 0) break;
+        length += n;
+        if (memchr(request+length-n,'\n',n)) break;
+    }
+    request[length] = '\0';
+
+    // Buffer the reply in memory, so an error can replace it
+    char * reply = NULL;
+    size_t reply_size = 0;
+    FILE * out = open_memstream(&reply,&reply_size);
+    const char * error = HandleRequest(out,request);
+    fclose(out);
+
+    FILE * stream = fdopen(fd,"w");
+    if (error) fprintf(stream,QUERY_ERROR "%s\n",error);
+    else fwrite(reply,1,reply_size,stream);
+    fclose(stream);
+
+    free(reply);
+    return NULL;
+}
+
+int main(int argc, char ** argv){
+    struct args args = {
+        .max_files = 16,
+        .cache_memory = 1024,
+    };
+    QueryDefaultSocket(args.socket,sizeof(args.socket));
+    struct argp argp = {
+        .options = options,
+        .doc = doc,
+        .parser = parse_opt,
+    };
+    error_t err = argp_parse(&argp, argc, argv, 0, NULL, &args);
+    cache.max_files = args.max_files;
+    cache.max_field_bytes = args.cache_memory*1024*1024;
+
+    // Clients going away shouldn't take the daemon with them
+    signal(SIGPIPE,SIG_IGN);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(args.socket) >= sizeof(addr.sun_path)){
+        fprintf(stderr,"Socket path %s is too long\n",args.socket);
+        exit(1);
+    }
+    strcpy(addr.sun_path,args.socket);
+
+    int sock = socket(AF_UNIX,SOCK_STREAM,0);
+    if (sock < 0){
+        perror("socket");
+        exit(-1);
+    }
+    // Don't take the socket from a daemon that is still running
+    int probe = socket(AF_UNIX,SOCK_STREAM,0);
+    if (probe >= 0 && connect(probe,(struct sockaddr *)&addr,sizeof(addr)) == 0){
+        fprintf(stderr,"ffserve is already running on %s\n",args.socket);
+        exit(1);
+    }
+    if (probe >= 0) close(probe);
+    unlink(args.socket);
+    // Only the owner may connect
+    mode_t mask = umask(077);
+    if (bind(sock,(struct sockaddr *)&addr,sizeof(addr)) != 0 ||
+        listen(sock,64) != 0){
+        perror(args.socket);
+        exit(-1);
+    }
+    umask(mask);
+
+    // Each connection gets its own thread
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+    while (1){
+        int fd = accept(sock,NULL,NULL);
+        if (fd < 0) continue;
+        // Idle clients mustn't hold on to a thread forever
+        struct timeval timeout = { .tv_sec = CLIENT_TIMEOUT };
+        setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+        setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+        pthread_t thread;
+        if (pthread_create(&thread,&attr,serve,(void *)(intptr_t)fd) != 0){
+            close(fd);
+        }
+    }
+}
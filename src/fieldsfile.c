@@ -1,24 +1,49 @@
 #include "fieldsfile.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
+// Returns 0 on success, -1 if the values couldn't be read
+#define be64read_checked(ptr,count,offset,stream) \
+    be64read_checked_(ptr,sizeof(*(ptr)),count,offset,stream)
+int be64read_checked_(void * ptr, size_t size, size_t count,
+                      size_t offset, FILE * stream){
+    if (offset < 1 ||
+        fseek(stream,(offset-1)*sizeof(int64_t),SEEK_SET) != 0) return -1;
+    size_t nread = fread(ptr,size,count,stream);
+    if (nread != count) return -1;
+    for (size_t i=0;i<size*count/sizeof(int64_t);++i){
+        ((int64_t*)ptr)[i] = _bswap64(((int64_t*)ptr)[i]);
+    }
+    return 0;
+}
 #define be64read(ptr,count,offset,stream) \
     be64read_(ptr,sizeof(*(ptr)),count,offset,stream)
 void be64read_(void * ptr, size_t size, size_t count,
                size_t offset, FILE * stream){
-    int err = fseek(stream,(offset-1)*sizeof(int64_t),SEEK_SET);
-    assert(err == 0);
-    size_t nread = fread(ptr,size,count,stream);
-    if (nread != count){
+    if (be64read_checked_(ptr,size,count,offset,stream) != 0){
         perror("be64read failed:");
         exit(-1); 
     }
-    for (size_t i=0;i<size*count/sizeof(int64_t);++i){
-        ((int64_t*)ptr)[i] = _bswap64(((int64_t*)ptr)[i]);
+}
+// Read count 32 bit values packed two to a word, starting at a word offset.
+// Returns 0 on success, -1 if the values couldn't be read.
+int be32read_checked(uint32_t * ptr, size_t count,
+                     size_t offset, FILE * stream){
+    if (offset < 1 ||
+        fseek(stream,(offset-1)*sizeof(int64_t),SEEK_SET) != 0) return -1;
+    size_t nread = fread(ptr,sizeof(*ptr),count,stream);
+    if (nread != count) return -1;
+    for (size_t i=0;i<count;++i){
+        ptr[i] = _bswap(ptr[i]);
     }
+    return 0;
 }
 #define be64write(ptr,count,offset,stream) \
     be64write_(ptr,sizeof(*(ptr)),count,offset,stream)
@@ -38,34 +63,131 @@ void be64write_(void * ptr, size_t size, size_t count,
     }
 }
 
-struct FieldsFile * OpenFieldsFile(const char * filename){
-    struct FieldsFile * this = malloc(sizeof(*this));
-    char * errmsg = NULL;
-    asprintf(&errmsg,"OpenFieldsFile(%s)",filename);
-    this->stream = fopen(filename,"r+");
+// Copy count words from offset in one file to offset in another, letting the
+// kernel move the data rather than going through a user-space buffer
+void be64copy(FILE * in, size_t in_offset,
+              FILE * out, size_t out_offset,
+              size_t count){
+    loff_t in_pos = (in_offset-1)*sizeof(int64_t);
+    loff_t out_pos = (out_offset-1)*sizeof(int64_t);
+    size_t remaining = count*sizeof(int64_t);
+
+    // Anything still buffered by stdio must reach the file first
+    fflush(out);
+    while (remaining > 0){
+        ssize_t ncopy = copy_file_range(fileno(in),&in_pos,
+                                        fileno(out),&out_pos,
+                                        remaining,0);
+        if (ncopy < 0 && (errno == EXDEV || errno == ENOSYS ||
+                          errno == EINVAL || errno == EOPNOTSUPP)){
+            // Not supported between these files, sendfile() writes at the
+            // output's current position
+            off_t pos = in_pos;
+            lseek(fileno(out),out_pos,SEEK_SET);
+            ncopy = sendfile(fileno(out),fileno(in),&pos,remaining);
+            if (ncopy > 0){
+                in_pos += ncopy;
+                out_pos += ncopy;
+            }
+        }
+        if (ncopy <= 0){
+            if (ncopy == 0) errno = EIO;
+            perror("be64copy failed:");
+            exit(-1);
+        }
+        remaining -= ncopy;
+    }
+}
+
+// Decoding state kept between reads of a file
+struct FFDecodeCache {
+    // Land-sea mask, decoded on first use. Indices of the land and sea points
+    // in the full grid, in order.
+    int mask_read;
+    size_t mask_points;
+    int * land;
+    size_t land_count;
+    int * sea;
+    size_t sea_count;
+
+    // Packed values are read here before being expanded
+    void * scratch;
+    size_t scratch_size;
+};
+
+// Open and check a file, returning NULL and setting *error on failure
+struct FieldsFile * OpenFile(const char * filename, const char * mode,
+                             const char ** error){
+    struct FieldsFile * this = calloc(1,sizeof(*this));
+    this->stream = fopen(filename,mode);
     if (!this->stream) {
-        perror(errmsg);
-        exit(-1);
+        *error = strerror(errno);
+        free(this);
+        return NULL;
     }
+    this->cache = calloc(1,sizeof(*(this->cache)));
 
     assert(sizeof(*(this->header))/sizeof(int64_t) == 256);
 
     size_t offset = 1;
     this->header = malloc(sizeof(*(this->header)));
-    be64read(this->header,1,offset,this->stream);
-    assert(this->header->version == 20 ||
-           this->header->version == IMDI);
+    if (be64read_checked(this->header,1,offset,this->stream) != 0){
+        *error = "file is truncated";
+        CloseFieldsFile(this);
+        return NULL;
+    }
+    if (this->header->version != 20 &&
+        this->header->version != IMDI){
+        *error = "not a UM file";
+        CloseFieldsFile(this);
+        return NULL;
+    }
+    if (sizeof(*(this->lookup))/sizeof(int64_t) != this->header->lookup_size){
+        *error = "observation files are not supported";
+        CloseFieldsFile(this);
+        return NULL;
+    }
 
-    assert((sizeof(*(this->lookup))/sizeof(int64_t) == this->header->lookup_size) &&
-           "Observation files are not supported");
+    // Check the lookup fits in the file before allocating space for it
+    struct stat st;
+    int64_t words = 0;
+    if (fstat(fileno(this->stream),&st) == 0) words = st.st_size/sizeof(int64_t);
+    if (this->header->field_count < 0 ||
+        this->header->lookup_start < 1 ||
+        this->header->lookup_start - 1 > words ||
+        this->header->field_count > (words - this->header->lookup_start + 1) /
+                                    this->header->lookup_size){
+        *error = "file is truncated";
+        CloseFieldsFile(this);
+        return NULL;
+    }
 
     offset = this->header->lookup_start;
     this->lookup = malloc(this->header->field_count * sizeof(*(this->lookup)));
-    be64read(this->lookup,this->header->field_count,offset,this->stream);
+    if (be64read_checked(this->lookup,this->header->field_count,
+                         offset,this->stream) != 0){
+        *error = "file is truncated";
+        CloseFieldsFile(this);
+        return NULL;
+    }
 
-    free(errmsg);
     return this;
 }
+struct FieldsFile * OpenFieldsFile(const char * filename){
+    const char * error = NULL;
+    struct FieldsFile * this = OpenFile(filename,"r+",&error);
+    if (!this) {
+        char * errmsg = NULL;
+        asprintf(&errmsg,"OpenFieldsFile(%s)",filename);
+        fprintf(stderr,"%s: %s\n",errmsg,error);
+        exit(-1);
+    }
+    return this;
+}
+struct FieldsFile * OpenFieldsFileChecked(const char * filename,
+                                          const char ** error){
+    return OpenFile(filename,"r",error);
+}
 void WriteFieldsFile(struct FieldsFile * this){
     size_t offset = 1;
     be64write(this->header,1,offset,this->stream);
@@ -73,11 +195,79 @@ void WriteFieldsFile(struct FieldsFile * this){
     offset = this->header->lookup_start;
     be64write(this->lookup,this->header->field_count,offset,this->stream);
 }
+void WriteFieldsFileSubset(struct FieldsFile * this,
+                           const char * filename,
+                           const int * fields,
+                           size_t count){
+    char * errmsg = NULL;
+    asprintf(&errmsg,"WriteFieldsFileSubset(%s)",filename);
+
+    // Opening the output truncates it, make sure that isn't the input
+    struct stat in_stat, out_stat;
+    if (fstat(fileno(this->stream),&in_stat) == 0 &&
+        stat(filename,&out_stat) == 0 &&
+        in_stat.st_dev == out_stat.st_dev &&
+        in_stat.st_ino == out_stat.st_ino){
+        fprintf(stderr,"%s: Output is the same file as the input\n",errmsg);
+        exit(-1);
+    }
+
+    struct FieldsFile out = {0};
+    out.stream = fopen(filename,"w+");
+    if (!out.stream) {
+        perror(errmsg);
+        exit(-1);
+    }
+
+    // The new lookup table is shorter, data follows straight after it
+    out.header = malloc(sizeof(*(out.header)));
+    *(out.header) = *(this->header);
+    out.header->field_count = count;
+    out.header->data_start = out.header->lookup_start +
+                             count * out.header->lookup_size;
+
+    size_t offset = out.header->data_start;
+    out.lookup = malloc(count * sizeof(*(out.lookup)));
+    for (size_t i=0;i<count;++i){
+        out.lookup[i] = this->lookup[fields[i]];
+        out.lookup[i].file_start = offset;
+        offset += FFRecordLength(&out.lookup[i]);
+    }
+    out.header->data_size = offset - out.header->data_start;
+
+    // Constants between the header and lookup are unchanged
+    size_t constants_start = 1 + sizeof(*(this->header))/sizeof(int64_t);
+    be64copy(this->stream,constants_start,
+             out.stream,constants_start,
+             this->header->lookup_start - constants_start);
+
+    WriteFieldsFile(&out);
+
+    for (size_t i=0;i<count;++i){
+        be64copy(this->stream,this->lookup[fields[i]].file_start,
+                 out.stream,out.lookup[i].file_start,
+                 FFRecordLength(&out.lookup[i]));
+    }
+
+    if (fclose(out.stream) != 0){
+        perror(errmsg);
+        exit(-1);
+    }
+    free(out.header);
+    free(out.lookup);
+    free(errmsg);
+}
 void CloseFieldsFile(struct FieldsFile * ff){
     if (ff){
         fclose(ff->stream);
         free(ff->header);
         free(ff->lookup);
+        if (ff->cache){
+            free(ff->cache->land);
+            free(ff->cache->sea);
+            free(ff->cache->scratch);
+        }
+        free(ff->cache);
     }
     free(ff);
 }
@@ -101,6 +291,26 @@ double FFDateToUnixTime(const struct FFDate date){
     tzset();
     return time;
 }
+int FFDateCompare(const struct FFDate a, const struct FFDate b){
+    const int64_t x[] = {a.year,a.month,a.day,a.hour,a.minute,a.second};
+    const int64_t y[] = {b.year,b.month,b.day,b.hour,b.minute,b.second};
+    for (int i=0;i<6;++i){
+        if (x[i] != y[i]) return (x[i] > y[i]) - (x[i] < y[i]);
+    }
+    return 0;
+}
+int FFDateToString(char * buffer, size_t size, const struct FFDate date){
+    return snprintf(buffer,size,"%04lld-%02lld-%02lldT%02lld:%02lld:%02lld",
+                    (long long)date.year,(long long)date.month,
+                    (long long)date.day,(long long)date.hour,
+                    (long long)date.minute,(long long)date.second);
+}
+int64_t FFRecordLength(const struct FFLookup * lookup){
+    // Older files may not set the record length, fall back to the data length
+    if (lookup->record_count > 0) return lookup->record_count;
+    if (lookup->data_length > 0) return lookup->data_length;
+    return lookup->rows*lookup->columns;
+}
 
 void ReadFieldsFileData(double ** data,
                         struct FieldsFile * this,
@@ -108,5 +318,193 @@ void ReadFieldsFileData(double ** data,
     size_t count = this->lookup[i].rows*this->lookup[i].columns;
 
     *data = realloc(*data,count*sizeof(**data));
-    be64read(*data,count,this->lookup[i].file_start,this->stream);
+    ReadFieldsFileDataBuffer(*data,this,i);
+}
+// Find and decode the land-sea mask, once per file. Returns NULL if the file
+// doesn't have a mask.
+struct FFDecodeCache * ReadMask(struct FieldsFile * this){
+    struct FFDecodeCache * cache = this->cache;
+    if (cache->mask_read) return cache->land ? cache : NULL;
+    cache->mask_read = 1;
+
+    int field = -1;
+    for (size_t i=0;i<this->header->field_count;++i){
+        if (this->lookup[i].stash_code == FF_LAND_SEA_MASK &&
+            this->lookup[i].packing == 0){
+            field = i;
+            break;
+        }
+    }
+    if (field < 0) return NULL;
+
+    // Logical and real masks are both zero at sea
+    size_t count = this->lookup[field].rows*this->lookup[field].columns;
+    int64_t * mask = malloc(count*sizeof(*mask));
+    if (count == 0 ||
+        be64read_checked(mask,count,this->lookup[field].file_start,
+                         this->stream) != 0){
+        free(mask);
+        return NULL;
+    }
+
+    cache->mask_points = count;
+    cache->land = malloc(count*sizeof(*(cache->land)));
+    cache->sea = malloc(count*sizeof(*(cache->sea)));
+    for (size_t i=0;i<count;++i){
+        if (mask[i] != 0) cache->land[cache->land_count++] = i;
+        else cache->sea[cache->sea_count++] = i;
+    }
+    free(mask);
+    return cache;
+}
+
+void * Scratch(struct FieldsFile * this, size_t size){
+    struct FFDecodeCache * cache = this->cache;
+    if (size > cache->scratch_size){
+        cache->scratch = realloc(cache->scratch,size);
+        cache->scratch_size = size;
+    }
+    return cache->scratch;
+}
+
+// Convert 32 bit values to double, written so the compiler can vectorise it
+void Widen32(double * restrict out, const float * restrict in, size_t count){
+    for (size_t i=0;i<count;++i){
+        out[i] = in[i];
+    }
+}
+
+// Expand compressed values onto the full grid
+void Expand(double * restrict out, const double * restrict in,
+            const int * restrict stored, size_t stored_count,
+            const int * restrict missing, size_t missing_count,
+            double missing_value){
+    for (size_t i=0;i<stored_count;++i){
+        out[stored[i]] = in[i];
+    }
+    for (size_t i=0;i<missing_count;++i){
+        out[missing[i]] = missing_value;
+    }
+}
+
+int CanReadFieldsFileData(struct FieldsFile * this,
+                          int i){
+    const struct FFLookup * lookup = &this->lookup[i];
+    int packing = lookup->packing % 10;
+    int compression = (lookup->packing / 10) % 10;
+    int points = (lookup->packing / 100) % 10;
+
+    if (packing != FF_PACK_NONE && packing != FF_PACK_32BIT) return 0;
+    if (compression == FF_COMPRESS_NONE) return 1;
+    if (compression != FF_COMPRESS_MASK) return 0;
+    if (points != FF_MASK_LAND && points != FF_MASK_SEA) return 0;
+
+    struct FFDecodeCache * mask = ReadMask(this);
+    return mask && mask->mask_points == lookup->rows*lookup->columns;
+}
+
+// Read and decode a field, returning NULL on success or an error message
+const char * ReadData(double * data,
+                      struct FieldsFile * this,
+                      int i){
+    const struct FFLookup * lookup = &this->lookup[i];
+    size_t count = lookup->rows*lookup->columns;
+
+    if (lookup->packing == 0){
+        if (be64read_checked(data,count,lookup->file_start,this->stream) != 0){
+            return "read failed";
+        }
+        return NULL;
+    }
+
+    if (!CanReadFieldsFileData(this,i)) return "unsupported packing";
+    int packing = lookup->packing % 10;
+    int compression = (lookup->packing / 10) % 10;
+    int points = (lookup->packing / 100) % 10;
+
+    // Which points of the grid are stored in the file
+    const int * stored = NULL;
+    const int * missing = NULL;
+    size_t stored_count = count;
+    size_t missing_count = 0;
+    if (compression == FF_COMPRESS_MASK){
+        struct FFDecodeCache * mask = this->cache;
+        int land = (points == FF_MASK_LAND);
+        stored = land ? mask->land : mask->sea;
+        stored_count = land ? mask->land_count : mask->sea_count;
+        missing = land ? mask->sea : mask->land;
+        missing_count = land ? mask->sea_count : mask->land_count;
+    }
+
+    size_t words = packing == FF_PACK_32BIT ? (stored_count+1)/2 : stored_count;
+    if (words > FFRecordLength(lookup)) return "field is larger than its record";
+
+    // Values are decoded straight into data if the field isn't compressed
+    double * values = data;
+    if (stored){
+        values = Scratch(this,stored_count*(sizeof(double)+sizeof(float)));
+    }
+    if (packing == FF_PACK_32BIT){
+        float * packed = (float *)(values + stored_count);
+        if (!stored) packed = Scratch(this,stored_count*sizeof(float));
+        if (be32read_checked((uint32_t *)packed,stored_count,
+                             lookup->file_start,this->stream) != 0){
+            return "read failed";
+        }
+        Widen32(values,packed,stored_count);
+    } else {
+        if (be64read_checked(values,stored_count,
+                             lookup->file_start,this->stream) != 0){
+            return "read failed";
+        }
+    }
+
+    if (stored){
+        Expand(data,values,stored,stored_count,missing,missing_count,
+               lookup->missing_data);
+    }
+    return NULL;
+}
+void ReadFieldsFileDataBuffer(double * data,
+                              struct FieldsFile * this,
+                              int i){
+    const char * error = ReadData(data,this,i);
+    if (error){
+        fprintf(stderr,"ReadFieldsFileData: Field %d (packing %lld): %s\n",
+                i,(long long)this->lookup[i].packing,error);
+        exit(-1);
+    }
+}
+int ReadFieldsFileDataChecked(double * data,
+                              struct FieldsFile * this,
+                              int i){
+    return ReadData(data,this,i) ? -1 : 0;
+}
+int ReadFieldsFileValueChecked(double * value,
+                               struct FieldsFile * this,
+                               int i,
+                               size_t index){
+    const struct FFLookup * lookup = &this->lookup[i];
+    int packing = lookup->packing % 10;
+    int compression = (lookup->packing / 10) % 10;
+    if (compression != FF_COMPRESS_NONE) return -1;
+    if (lookup->rows <= 0 || lookup->columns <= 0 ||
+        index >= (size_t)(lookup->rows*lookup->columns)) return -1;
+
+    if (packing == FF_PACK_NONE){
+        if (index >= FFRecordLength(lookup)) return -1;
+        return be64read_checked(value,1,lookup->file_start+index,this->stream);
+    }
+    if (packing == FF_PACK_32BIT){
+        // Read the word holding the value
+        uint32_t packed[2];
+        if (index/2 >= FFRecordLength(lookup) ||
+            be32read_checked(packed,2,lookup->file_start+index/2,
+                             this->stream) != 0) return -1;
+        float f;
+        memcpy(&f,&packed[index%2],sizeof(f));
+        *value = f;
+        return 0;
+    }
+    return -1;
 }
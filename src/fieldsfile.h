@@ -8,8 +8,9 @@
  * for constants, a lookup table for data values and the data values
  * themselves. The full format is described in UM technical paper F3.
  *
- * This interface provides functions to open, close and write an output file.
- * The file must be accessable in random-access mode. The object returned by
+ * This interface provides functions to open, close and write an output file,
+ * and to write a subset of an open file's fields to a new file. The file must
+ * be accessable in random-access mode. The object returned by
  * the open function contains the header and lookup table. Some entries have
  * descriptive names, others use placeholders since not all entries are defined
  * by the format.
@@ -43,6 +44,7 @@ extern "C" {
 
 struct FFHeader;
 struct FFLookup;
+struct FFDecodeCache;
 
 /** @defgroup fieldsfile
  *  @{
@@ -59,6 +61,7 @@ struct FieldsFile {
     FILE * stream;
     struct FFHeader * header;
     struct FFLookup * lookup;
+    struct FFDecodeCache * cache; ///< Private to the read functions
 };
 
 /** 
@@ -69,6 +72,16 @@ struct FieldsFile {
  */
 struct FieldsFile * OpenFieldsFile(const char * filename);
 
+/**
+ * @brief Open a file read-only, returning errors rather than exiting
+ *
+ * Returns NULL and points \p error at a description of the problem if the
+ * file can't be opened or isn't a valid UM file. The file must not be passed
+ * to WriteFieldsFile().
+ */
+struct FieldsFile * OpenFieldsFileChecked(const char * filename,
+                                          const char ** error);
+
 /**
  * @brief Write a file to disk
  *
@@ -77,15 +90,74 @@ struct FieldsFile * OpenFieldsFile(const char * filename);
  */
 void WriteFieldsFile(struct FieldsFile * ff);
 
+/**
+ * @brief Write a subset of the fields to a new file
+ *
+ * A new file \p filename is created holding the header and constants of \p ff
+ * and the \p count lookup entries listed in \p fields, in that order. Data
+ * records are copied between the files by the kernel without passing through
+ * a user-space buffer. The header and lookup offsets of the new file are
+ * recomputed, \p ff itself is not modified. If an error occurs the function
+ * will call perror() and exit(-1).
+ */
+void WriteFieldsFileSubset(struct FieldsFile * ff,
+                           const char * filename,
+                           const int * fields,
+                           size_t count);
+
 /**
  * @brief Read a single 2D field from the fields file
  *
- * Data array will be resized as needed
+ * Data array will be resized as needed. Fields packed as 32 bit values are
+ * widened to double, land or sea compressed fields are expanded to the full
+ * grid using the file's land-sea mask with the other points set to the
+ * field's missing_data value. If the field can't be decoded (see
+ * CanReadFieldsFileData()) the function will print an error and exit(-1).
  */
 void ReadFieldsFileData(double ** data,
                         struct FieldsFile * ff,
                         int field);
 
+/**
+ * @brief Check whether ReadFieldsFileData() can decode a field
+ *
+ * Returns 0 if the field uses an unsupported packing (e.g. WGDOS), or is
+ * compressed and the file has no matching land-sea mask
+ */
+int CanReadFieldsFileData(struct FieldsFile * ff,
+                          int field);
+
+/**
+ * @brief Read a single 2D field into an existing buffer
+ *
+ * @pre \p data must hold rows*columns values of the field's lookup entry
+ */
+void ReadFieldsFileDataBuffer(double * data,
+                              struct FieldsFile * ff,
+                              int field);
+
+/**
+ * @brief Read a single 2D field into an existing buffer, without exiting
+ *
+ * As ReadFieldsFileDataBuffer(), but returns -1 if the field can't be read
+ * or decoded (e.g. the file is truncated) and 0 on success
+ */
+int ReadFieldsFileDataChecked(double * data,
+                              struct FieldsFile * ff,
+                              int field);
+
+/**
+ * @brief Read a single value of a field without decoding the whole field
+ *
+ * \p index is the position of the value in the field, row*columns + column.
+ * Only fields that aren't compressed can be read this way. Returns -1 if the
+ * field is compressed or the value can't be read, 0 on success.
+ */
+int ReadFieldsFileValueChecked(double * value,
+                               struct FieldsFile * ff,
+                               int field,
+                               size_t index);
+
 /**
  * @brief Close the file, flushing & freeing buffers
  *
@@ -98,6 +170,28 @@ void CloseFieldsFile(struct FieldsFile * ff);
 /// Missing data constant
 static const int64_t IMDI = -32768;
 
+/// Stash code of the land-sea mask, used to expand compressed fields
+static const int64_t FF_LAND_SEA_MASK = 30;
+
+/// Packing of field data, the units digit of FFLookup::packing
+enum FFPacking {
+    FF_PACK_NONE  = 0,
+    FF_PACK_WGDOS = 1,
+    FF_PACK_32BIT = 2,
+};
+
+/// Compression of field data, the tens digit of FFLookup::packing
+enum FFCompression {
+    FF_COMPRESS_NONE = 0,
+    FF_COMPRESS_MASK = 2,
+};
+
+/// Points stored by mask compression, the hundreds digit of FFLookup::packing
+enum FFMaskPoints {
+    FF_MASK_LAND = 1,
+    FF_MASK_SEA  = 2,
+};
+
 /**
  * @brief Date container
  *
@@ -117,6 +211,25 @@ struct FFDate {
 
 double FFDateToUnixTime(const struct FFDate date);
 
+/**
+ * @brief Compare two dates, returning <0, 0 or >0 like strcmp()
+ */
+int FFDateCompare(const struct FFDate a, const struct FFDate b);
+
+/**
+ * @brief Format a date as YYYY-MM-DDTHH:MM:SS
+ *
+ * Returns the result of snprintf()
+ */
+int FFDateToString(char * buffer, size_t size, const struct FFDate date);
+
+/**
+ * @brief Length in words of the data record of a lookup entry on disk
+ *
+ * Includes any padding at the end of the record.
+ */
+int64_t FFRecordLength(const struct FFLookup * lookup);
+
 /**
  * @brief Header structure
  *
@@ -182,7 +295,7 @@ struct FFHeader {
     int64_t u158;
     int64_t u159;
     int64_t data_start;
-    int64_t u161;
+    int64_t data_size;
     int64_t u162;
     int64_t u163;
     int64_t u164;
@@ -210,7 +323,7 @@ struct FFLookup {
     int64_t rows;
     int64_t columns;
     int64_t u20;
-    int64_t u21;
+    int64_t packing;
     int64_t u22;
     int64_t u23;
     int64_t u24;
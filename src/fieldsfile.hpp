@@ -0,0 +1,356 @@
+/**
+ * \file    fieldsfile.hpp
+ * \author  Scott Wales (scott.wales@unimelb.edu.au)
+ * \brief   C++ interface for working with UM output files
+ *
+ * A header-only layer over fieldsfile.h for C++ tools. fieldsfile::File owns
+ * an open file and maps it into memory, fieldsfile::LookupRange iterates
+ * over the lookup entries matching a fieldsfile::Filter and
+ * fieldsfile::Reader decodes fields into a buffer allocated once up front,
+ * returning a fieldsfile::FieldView of the data. None of these allocate while
+ * iterating, so a loop over fields does no heap traffic.
+ *
+ * Unpacked and 32 bit packed fields are decoded straight from the mapped
+ * file, by a decode function specialised for each packing at compile time.
+ * Compressed fields are decoded by ReadFieldsFileDataChecked(), which caches
+ * the land-sea mask.
+ *
+ * Requires C++20 for std::span.
+ *
+ * Copyright 2013 ARC Centre of Excellence for Climate System Science
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FIELDSFILE_HPP
+#define FIELDSFILE_HPP
+
+#include "fieldsfile.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace fieldsfile {
+
+/** @defgroup fieldsfile_cpp
+ *  @{
+ */
+
+/**
+ * @brief An open UM file, closed when the object is destroyed
+ *
+ * The file is opened read-only and mapped into memory for the decoders.
+ * Readers refer to the file they were created from, so a File can't be
+ * copied or moved.
+ */
+class File {
+public:
+    /// Open a file, see OpenFieldsFileChecked(). Throws on errors.
+    explicit File(const char * filename) {
+        const char * error = nullptr;
+        ff_ = OpenFieldsFileChecked(filename,&error);
+        if (!ff_) {
+            throw std::runtime_error(std::string(filename) + ": " + error);
+        }
+        struct stat st;
+        if (fstat(fileno(ff_->stream),&st) == 0) {
+            size_ = st.st_size;
+            map_ = mmap(nullptr,size_,PROT_READ,MAP_SHARED,
+                        fileno(ff_->stream),0);
+        }
+        if (map_ == MAP_FAILED) {
+            int err = errno;
+            CloseFieldsFile(ff_);
+            throw std::system_error(err,std::generic_category(),filename);
+        }
+    }
+
+    File(const File &) = delete;
+    File & operator=(const File &) = delete;
+
+    ~File() {
+        if (map_ != MAP_FAILED) munmap(map_,size_);
+        CloseFieldsFile(ff_);
+    }
+
+    /// The underlying C file object
+    FieldsFile * get() const { return ff_; }
+
+    const FFHeader & header() const { return *ff_->header; }
+
+    std::span<const FFLookup> lookup() const {
+        return {ff_->lookup,static_cast<std::size_t>(ff_->header->field_count)};
+    }
+
+    /// Data record of a field as mapped from the file, still big-endian
+    std::span<const std::byte> record(int field) const {
+        const FFLookup & l = ff_->lookup[field];
+        std::size_t start = (l.file_start-1)*sizeof(std::int64_t);
+        std::size_t length = FFRecordLength(&l)*sizeof(std::int64_t);
+        if (start > size_ || length > size_ - start) {
+            throw std::out_of_range("fieldsfile: record past end of file");
+        }
+        return {static_cast<const std::byte *>(map_) + start,length};
+    }
+
+private:
+    FieldsFile * ff_ = nullptr;
+    void * map_ = MAP_FAILED;
+    std::size_t size_ = 0;
+};
+
+/**
+ * @brief Selects lookup entries by stash code, valid time and level
+ *
+ * Unset members match everything, the time range is inclusive.
+ */
+struct Filter {
+    std::optional<std::int64_t> stash;
+    std::optional<FFDate> start;
+    std::optional<FFDate> end;
+    std::optional<double> level;
+
+    bool operator()(const FFLookup & l) const {
+        if (stash && l.stash_code != *stash) return false;
+        if (start && FFDateCompare(l.valid_time,*start) < 0) return false;
+        if (end && FFDateCompare(l.valid_time,*end) > 0) return false;
+        if (level && l.heightlevel != *level) return false;
+        return true;
+    }
+};
+
+/// A lookup entry and its index in the file
+struct Entry {
+    int index;
+    const FFLookup * lookup;
+};
+
+/**
+ * @brief The lookup entries of a file matching a filter
+ *
+ * Entries are visited in file order, the range holds no copies of the lookup.
+ */
+class LookupRange {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Entry;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Entry *;
+        using reference = Entry;
+
+        iterator() = default;
+        iterator(std::span<const FFLookup> lookup, const Filter * filter,
+                 std::size_t i)
+            : lookup_(lookup), filter_(filter), i_(i) { skip(); }
+
+        Entry operator*() const {
+            return {static_cast<int>(i_),&lookup_[i_]};
+        }
+        iterator & operator++() { ++i_; skip(); return *this; }
+        iterator operator++(int) { iterator old = *this; ++*this; return old; }
+        bool operator==(const iterator & other) const { return i_ == other.i_; }
+
+    private:
+        void skip() {
+            while (i_ < lookup_.size() && !(*filter_)(lookup_[i_])) ++i_;
+        }
+
+        std::span<const FFLookup> lookup_;
+        const Filter * filter_ = nullptr;
+        std::size_t i_ = 0;
+    };
+
+    LookupRange(const File & file, Filter filter)
+        : lookup_(file.lookup()), filter_(std::move(filter)) {}
+
+    iterator begin() const { return {lookup_,&filter_,0}; }
+    iterator end() const { return {lookup_,&filter_,lookup_.size()}; }
+
+private:
+    std::span<const FFLookup> lookup_;
+    Filter filter_;
+};
+
+/// Entries of \p file matching \p filter
+inline LookupRange select(const File & file, Filter filter = {}) {
+    return LookupRange(file,std::move(filter));
+}
+
+/**
+ * @brief A 2D view of a field's values, row major
+ */
+class FieldView {
+public:
+    FieldView(const double * data, std::size_t rows, std::size_t columns)
+        : data_(data), rows_(rows), columns_(columns) {}
+
+    std::size_t rows() const { return rows_; }
+    std::size_t columns() const { return columns_; }
+
+    const double & operator()(std::size_t row, std::size_t column) const {
+        return data_[row*columns_ + column];
+    }
+
+    std::span<const double> row(std::size_t r) const {
+        return {data_ + r*columns_,columns_};
+    }
+
+    std::span<const double> values() const {
+        return {data_,rows_*columns_};
+    }
+
+private:
+    const double * data_;
+    std::size_t rows_;
+    std::size_t columns_;
+};
+
+/// How a field's data is stored, selects the decoder used
+enum class Packing {
+    None,       ///< 64 bit values
+    Packed32,   ///< 32 bit values
+    Compressed, ///< Land or sea compressed, decoded by the C library
+    Unsupported,
+};
+
+inline Packing packing(const FFLookup & l) {
+    if (l.packing == 0) return Packing::None;
+    int n1 = l.packing % 10;
+    int n2 = (l.packing / 10) % 10;
+    if (n2 == FF_COMPRESS_MASK &&
+        (n1 == FF_PACK_NONE || n1 == FF_PACK_32BIT)) return Packing::Compressed;
+    if (n2 != FF_COMPRESS_NONE) return Packing::Unsupported;
+    if (n1 == FF_PACK_NONE) return Packing::None;
+    if (n1 == FF_PACK_32BIT) return Packing::Packed32;
+    return Packing::Unsupported;
+}
+
+/// Decode \p out.size() values of a record, specialised for each packing
+template <Packing P>
+void decode(const File & file, int field, std::span<double> out);
+
+template <>
+inline void decode<Packing::None>(const File & file, int field,
+                                  std::span<double> out) {
+    auto record = file.record(field);
+    if (record.size() < out.size()*sizeof(std::uint64_t)) {
+        throw std::out_of_range("fieldsfile: field larger than its record");
+    }
+    const std::byte * in = record.data();
+    for (std::size_t i=0;i<out.size();++i) {
+        std::uint64_t v;
+        std::memcpy(&v,in + i*sizeof(v),sizeof(v));
+        v = __builtin_bswap64(v);
+        std::memcpy(&out[i],&v,sizeof(v));
+    }
+}
+
+template <>
+inline void decode<Packing::Packed32>(const File & file, int field,
+                                      std::span<double> out) {
+    auto record = file.record(field);
+    if (record.size() < out.size()*sizeof(std::uint32_t)) {
+        throw std::out_of_range("fieldsfile: field larger than its record");
+    }
+    const std::byte * in = record.data();
+    for (std::size_t i=0;i<out.size();++i) {
+        std::uint32_t v;
+        std::memcpy(&v,in + i*sizeof(v),sizeof(v));
+        v = __builtin_bswap32(v);
+        float f;
+        std::memcpy(&f,&v,sizeof(f));
+        out[i] = f;
+    }
+}
+
+template <>
+inline void decode<Packing::Compressed>(const File & file, int field,
+                                        std::span<double> out) {
+    if (ReadFieldsFileDataChecked(out.data(),file.get(),field) != 0) {
+        throw std::runtime_error("fieldsfile: cannot read field");
+    }
+}
+
+/**
+ * @brief Decodes fields into a buffer owned by the reader
+ *
+ * The buffer is sized for the largest field in the file when the reader is
+ * created. Each read overwrites the previous field's data, so a FieldView
+ * is only valid until the next read. The reader keeps a reference to its
+ * File, which must outlive it.
+ */
+class Reader {
+public:
+    explicit Reader(const File & file) : file_(&file) {
+        std::size_t largest = 0;
+        for (const FFLookup & l : file.lookup()) {
+            largest = std::max<std::size_t>(largest,l.rows*l.columns);
+        }
+        buffer_.resize(largest);
+    }
+
+    /// Decode a field whose packing is known at compile time. Throws
+    /// std::invalid_argument if the field is packed some other way.
+    template <Packing P>
+    FieldView read(const Entry & e) {
+        if (packing(*e.lookup) != P) {
+            throw std::invalid_argument("fieldsfile: field has a different "
+                                        "packing");
+        }
+        std::span<double> out(buffer_.data(),e.lookup->rows*e.lookup->columns);
+        decode<P>(*file_,e.index,out);
+        return {buffer_.data(),static_cast<std::size_t>(e.lookup->rows),
+                static_cast<std::size_t>(e.lookup->columns)};
+    }
+
+    /// Decode a field, choosing the decoder from its lookup entry
+    FieldView read(const Entry & e) {
+        switch (packing(*e.lookup)) {
+            case Packing::None:       return read<Packing::None>(e);
+            case Packing::Packed32:   return read<Packing::Packed32>(e);
+            case Packing::Compressed:
+                if (!CanReadFieldsFileData(file_->get(),e.index)) break;
+                return read<Packing::Compressed>(e);
+            case Packing::Unsupported: break;
+        }
+        throw std::runtime_error("fieldsfile: unsupported field packing");
+    }
+
+private:
+    const File * file_;
+    std::vector<double> buffer_;
+};
+
+/**
+ * @}
+ */
+
+} // namespace fieldsfile
+
+#endif
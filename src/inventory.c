@@ -0,0 +1,302 @@
+/*
+ * \file    inventory.c
+ * \author  Scott Wales (scott.wales@unimelb.edu.au)
+ * \brief   Summarise the contents of a UM file by STASH code
+ *
+ * Copyright 2013 ARC Centre of Excellence for Climate System Science
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fieldsfile.h"
+#include <argp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char * doc = "Prints a summary of each STASH variable in a UM file: "
+                   "the number of fields, valid time range, levels, pseudo "
+                   "levels, grid shape and size on disk";
+
+const char * argp_program_version     = "0";
+const char * argp_program_bug_address = "scott.wales@unimelb.edu.au";
+
+struct args {
+    const char * filename;
+    int json;
+};
+
+struct argp_option options[] = {
+    {"json", 'j', 0, 0, "Print the summary as JSON"},
+    {0},
+};
+
+const char * args_doc = "FILENAME";
+error_t parse_opt(int key, char * arg, struct argp_state * state){
+    struct args * args = state->input;
+    switch (key){
+        case 'j':
+            args->json = 1;
+            break;
+        case ARGP_KEY_ARG:
+            // Unnamed argument
+            switch (state->arg_num){
+                case 0:
+                    args->filename = arg;
+                    break;
+                default:
+                    argp_usage(state);
+                    break;
+            }
+            break;
+        case ARGP_KEY_END:
+            // End of arguments
+            if (state->arg_num < 1) argp_usage(state);
+            break;
+        default:
+            // Unknown argument
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+// Hash set of unique doubles using open addressing. Values are compared by
+// their bit pattern.
+struct valueset {
+    size_t count;
+    size_t capacity;
+    int64_t * values;
+    char * used;
+};
+
+uint64_t hash64(uint64_t key){
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+void ValueSetAdd(struct valueset * set, double value){
+    int64_t key;
+    memcpy(&key,&value,sizeof(key));
+
+    if (2*(set->count+1) > set->capacity){
+        // Keep the load factor below 1/2
+        struct valueset old = *set;
+        set->capacity = old.capacity ? 2*old.capacity : 16;
+        set->count = 0;
+        set->values = malloc(set->capacity*sizeof(*(set->values)));
+        set->used = calloc(set->capacity,sizeof(*(set->used)));
+        for (size_t i=0;i<old.capacity;++i){
+            if (old.used[i]){
+                double v;
+                memcpy(&v,&old.values[i],sizeof(v));
+                ValueSetAdd(set,v);
+            }
+        }
+        free(old.values);
+        free(old.used);
+    }
+
+    size_t i = hash64(key) & (set->capacity-1);
+    while (set->used[i]){
+        if (set->values[i] == key) return;
+        i = (i+1) & (set->capacity-1);
+    }
+    set->used[i] = 1;
+    set->values[i] = key;
+    set->count++;
+}
+
+int compare_double(const void * a, const void * b){
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Sorted array of the values in the set, the caller should free it
+double * ValueSetToArray(const struct valueset * set){
+    double * array = malloc(set->count*sizeof(*array));
+    size_t n = 0;
+    for (size_t i=0;i<set->capacity;++i){
+        if (set->used[i]) memcpy(&array[n++],&set->values[i],sizeof(*array));
+    }
+    qsort(array,n,sizeof(*array),compare_double);
+    return array;
+}
+
+void ValueSetFree(struct valueset * set){
+    free(set->values);
+    free(set->used);
+}
+
+// Summary of all fields sharing a STASH code
+struct entry {
+    int64_t stash;
+    size_t count;
+    struct FFDate first;
+    struct FFDate last;
+    struct valueset levels;
+    struct valueset pseudos;
+    int64_t rows;
+    int64_t columns;
+    int grid_varies;
+    int64_t bytes;
+};
+
+// Hash table of entries keyed by STASH code using open addressing. Slots are
+// indices into entries, -1 when empty.
+struct inventory {
+    size_t count;
+    size_t capacity;
+    struct entry * entries;
+    ptrdiff_t * slots;
+};
+
+struct entry * InventoryFind(struct inventory * inv, int64_t stash){
+    if (2*(inv->count+1) > inv->capacity){
+        // Grow the table, entries stay where they are
+        free(inv->slots);
+        inv->capacity = inv->capacity ? 2*inv->capacity : 64;
+        inv->slots = malloc(inv->capacity*sizeof(*(inv->slots)));
+        for (size_t i=0;i<inv->capacity;++i) inv->slots[i] = -1;
+        for (size_t e=0;e<inv->count;++e){
+            size_t i = hash64(inv->entries[e].stash) & (inv->capacity-1);
+            while (inv->slots[i] >= 0) i = (i+1) & (inv->capacity-1);
+            inv->slots[i] = e;
+        }
+        inv->entries = realloc(inv->entries,
+                               inv->capacity*sizeof(*(inv->entries)));
+    }
+
+    size_t i = hash64(stash) & (inv->capacity-1);
+    while (inv->slots[i] >= 0){
+        struct entry * e = &inv->entries[inv->slots[i]];
+        if (e->stash == stash) return e;
+        i = (i+1) & (inv->capacity-1);
+    }
+
+    inv->slots[i] = inv->count;
+    struct entry * e = &inv->entries[inv->count++];
+    memset(e,0,sizeof(*e));
+    e->stash = stash;
+    return e;
+}
+
+void InventoryAdd(struct inventory * inv, const struct FFLookup * lookup){
+    struct entry * e = InventoryFind(inv,lookup->stash_code);
+
+    if (e->count == 0){
+        e->first = lookup->valid_time;
+        e->last = lookup->valid_time;
+        e->rows = lookup->rows;
+        e->columns = lookup->columns;
+    } else {
+        if (FFDateCompare(lookup->valid_time,e->first) < 0)
+            e->first = lookup->valid_time;
+        if (FFDateCompare(lookup->valid_time,e->last) > 0)
+            e->last = lookup->valid_time;
+        if (lookup->rows != e->rows || lookup->columns != e->columns)
+            e->grid_varies = 1;
+    }
+    ValueSetAdd(&e->levels,lookup->heightlevel);
+    ValueSetAdd(&e->pseudos,lookup->pseudo_dimension);
+    e->bytes += FFRecordLength(lookup)*sizeof(int64_t);
+    e->count++;
+}
+
+int compare_entry(const void * a, const void * b){
+    int64_t x = ((const struct entry *)a)->stash;
+    int64_t y = ((const struct entry *)b)->stash;
+    return (x > y) - (x < y);
+}
+
+void print_date(const char * format, const struct FFDate * date){
+    char buffer[64];
+    FFDateToString(buffer,sizeof(buffer),*date);
+    printf(format,buffer);
+}
+
+// Print the values with format, each preceded by separator after the first
+void print_values(const struct valueset * set, const char * format,
+                  const char * separator){
+    double * values = ValueSetToArray(set);
+    for (size_t i=0;i<set->count;++i){
+        if (i) printf("%s",separator);
+        printf(format,values[i]);
+    }
+    free(values);
+}
+
+void print_text(const struct entry * e){
+    printf("%lld\tcount=%zu",e->stash,e->count);
+    print_date("\ttime=%s",&e->first);
+    print_date("/%s",&e->last);
+    printf("\tlevels=");
+    print_values(&e->levels,"%g",",");
+    printf("\tpseudo=");
+    print_values(&e->pseudos,"%g",",");
+    if (e->grid_varies) printf("\tgrid=varies");
+    else printf("\tgrid=%lldx%lld",e->rows,e->columns);
+    printf("\tbytes=%lld\n",e->bytes);
+}
+
+void print_json(const struct entry * e, int last){
+    printf("  {\"stash\": %lld, \"count\": %zu,",e->stash,e->count);
+    print_date(" \"start\": \"%s\",",&e->first);
+    print_date(" \"end\": \"%s\",",&e->last);
+    printf(" \"levels\": [");
+    print_values(&e->levels,"%.17g",", ");
+    printf("], \"pseudo_levels\": [");
+    print_values(&e->pseudos,"%.17g",", ");
+    if (e->grid_varies) printf("], \"grid\": null,");
+    else printf("], \"grid\": [%lld, %lld],",e->rows,e->columns);
+    printf(" \"bytes\": %lld}%s\n",e->bytes,last ? "" : ",");
+}
+
+int main(int argc, char ** argv){
+    struct args args = {0};
+    struct argp argp = {
+        .options = options,
+        .doc = doc,
+        .args_doc = args_doc,
+        .parser = parse_opt,
+    };
+    error_t err = argp_parse(&argp, argc, argv, 0, NULL, &args);
+
+    struct FieldsFile * ff = OpenFieldsFile(args.filename);
+
+    // Single pass over the lookup, aggregating by STASH code
+    struct inventory inv = {0};
+    for (size_t i=0;i<ff->header->field_count;++i){
+        InventoryAdd(&inv,&ff->lookup[i]);
+    }
+
+    // Only the distinct codes need sorting for output
+    qsort(inv.entries,inv.count,sizeof(*(inv.entries)),compare_entry);
+
+    if (args.json) printf("[\n");
+    for (size_t e=0;e<inv.count;++e){
+        if (args.json) print_json(&inv.entries[e],e+1 == inv.count);
+        else print_text(&inv.entries[e]);
+
+        ValueSetFree(&inv.entries[e].levels);
+        ValueSetFree(&inv.entries[e].pseudos);
+    }
+    if (args.json) printf("]\n");
+
+    free(inv.entries);
+    free(inv.slots);
+    CloseFieldsFile(ff);
+}
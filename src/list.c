@@ -47,9 +47,12 @@ int ListCount(const struct list * list){
 }
 void ListToArray(double ** array, const struct list * list){
     *array = realloc(*array,ListCount(list)*sizeof(**array));
+    ListToBuffer(*array,list);
+}
+void ListToBuffer(double * array, const struct list * list){
     int i=0;
     while (list != NULL){
-        (*array)[i++] = list->value;
+        array[i++] = list->value;
         list = list->next;
     }
 }
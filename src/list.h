@@ -51,6 +51,14 @@ void ListAdd(struct list ** list, double value);
  */
 void ListToArray(double ** array, const struct list * list);
 
+/** 
+ * @brief Copies the list into an existing buffer
+ *
+ * @pre  \p array must hold ListCount(list) values
+ * @post \p array holds a sorted list of the unique values held in \p *list
+ */
+void ListToBuffer(double * array, const struct list * list);
+
 /** 
  * @brief Finds the sorted index of value within \p *list
  */
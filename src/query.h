@@ -0,0 +1,68 @@
+/**
+ * \file    query.h
+ * \author  Scott Wales (scott.wales@unimelb.edu.au)
+ * \brief   Protocol shared by the ffserve daemon and ffquery client
+ *
+ * Clients connect to the daemon over a Unix domain socket and send a single
+ * line holding a command and its arguments separated by spaces. The daemon
+ * replies with plain text and closes the connection. If the request fails the
+ * reply is a single line starting with QUERY_ERROR.
+ *
+ * Commands are:
+ *   - describe FILE STASH
+ *        One line per field with that stash code, in valid time order:
+ *        the field's number N, valid time, height, pseudo level and size
+ *   - slice FILE STASH N
+ *        The values of field N of the stash code, one row per line
+ *   - series FILE STASH ROW COLUMN
+ *        Valid time, height, pseudo level and value at a single point for
+ *        each field of the stash code
+ *
+ * Copyright 2013 ARC Centre of Excellence for Climate System Science
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/** @defgroup query
+ *  @{
+ */
+
+/// Prefix of an error reply
+#define QUERY_ERROR "error: "
+
+/// Longest request line accepted by the daemon
+#define QUERY_MAX_REQUEST 4096
+
+/**
+ * @brief Default path of the daemon's socket
+ *
+ * Inside $XDG_RUNTIME_DIR if set, otherwise a per-user file in /tmp
+ */
+static inline void QueryDefaultSocket(char * path, size_t size){
+    const char * dir = getenv("XDG_RUNTIME_DIR");
+    if (dir) snprintf(path,size,"%s/fieldsfile.sock",dir);
+    else snprintf(path,size,"/tmp/fieldsfile-%d.sock",(int)getuid());
+}
+
+/**
+ * @}
+ */
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * \file    subsetfields.c
+ * \author  Scott Wales (scott.wales@unimelb.edu.au)
+ * \brief   Copy selected fields of a UM file into a new file
+ *
+ * Copyright 2013 ARC Centre of Excellence for Climate System Science
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fieldsfile.h"
+#include <argp.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+const char * doc = "Copies the fields matching the given STASH codes and valid "
+                   "time range into a new UM file. With no options every "
+                   "field is copied. The land-sea mask is always kept if any "
+                   "copied field is land or sea compressed.";
+
+const char * argp_program_version     = "0";
+const char * argp_program_bug_address = "scott.wales@unimelb.edu.au";
+
+struct args {
+    const char * filename;
+    const char * output;
+    int * stash;
+    size_t stash_count;
+    double start;
+    double end;
+};
+
+enum {
+    OPT_START = 1000,
+    OPT_END,
+};
+
+struct argp_option options[] = {
+    {"stash", 's', "CODE", 0, "Copy fields with this STASH code, may be repeated"},
+    {"start", OPT_START, "DATE", 0, "Copy fields valid at or after DATE (YYYY-MM-DDTHH:MM:SS)"},
+    {"end",   OPT_END,   "DATE", 0, "Copy fields valid at or before DATE (YYYY-MM-DDTHH:MM:SS)"},
+    {0},
+};
+
+// Parse a date, trailing time components may be left off
+int parse_date(const char * arg, double * time){
+    struct FFDate date = {0};
+    int match = sscanf(arg,"%lld-%lld-%lldT%lld:%lld:%lld",
+                       &date.year,&date.month,&date.day,
+                       &date.hour,&date.minute,&date.second);
+    if (match < 3) return 0;
+    *time = FFDateToUnixTime(date);
+    return 1;
+}
+
+const char * args_doc = "FILENAME OUTPUT";
+error_t parse_opt(int key, char * arg, struct argp_state * state){
+    struct args * args = state->input;
+    switch (key){
+        case 's':
+            {
+                int stash;
+                int match = sscanf(arg,"%d",&stash);
+                if (match != 1) argp_usage(state);
+                args->stash = realloc(args->stash,
+                        (args->stash_count+1)*sizeof(*(args->stash)));
+                args->stash[args->stash_count++] = stash;
+                break;
+            }
+        case OPT_START:
+            if (!parse_date(arg,&(args->start))) argp_usage(state);
+            break;
+        case OPT_END:
+            if (!parse_date(arg,&(args->end))) argp_usage(state);
+            break;
+        case ARGP_KEY_ARG:
+            // Unnamed argument
+            switch (state->arg_num){
+                case 0:
+                    args->filename = arg;
+                    break;
+                case 1:
+                    args->output = arg;
+                    break;
+                default:
+                    argp_usage(state);
+                    break;
+            }
+            break;
+        case ARGP_KEY_END:
+            // End of arguments
+            if (state->arg_num < 2) argp_usage(state);
+            break;
+        default:
+            // Unknown argument
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv){
+    struct args args = {
+        .start = -INFINITY,
+        .end = INFINITY,
+    };
+    struct argp argp = {
+        .options = options,
+        .doc = doc,
+        .args_doc = args_doc,
+        .parser = parse_opt,
+    };
+    error_t err = argp_parse(&argp, argc, argv, 0, NULL, &args);
+
+    struct FieldsFile * ff = OpenFieldsFile(args.filename);
+
+    // Indices of the fields to copy, in file order
+    int * fields = malloc(ff->header->field_count*sizeof(*fields));
+    size_t count = 0;
+    for (size_t i=0;i<ff->header->field_count;++i){
+        int keep = (args.stash_count == 0);
+        for (size_t s=0;s<args.stash_count;++s){
+            if (ff->lookup[i].stash_code == args.stash[s]) keep = 1;
+        }
+        double time = FFDateToUnixTime(ff->lookup[i].valid_time);
+        if (time < args.start || time > args.end) keep = 0;
+
+        if (keep) fields[count++] = i;
+    }
+    if (!count){
+        fprintf(stderr, "No matching fields present in file\n");
+        exit(1);
+    }
+
+    // Compressed fields can only be decoded using the land-sea mask, so copy
+    // the mask too if it wasn't selected
+    int compressed = 0;
+    int has_mask = 0;
+    for (size_t n=0;n<count;++n){
+        const struct FFLookup * lookup = &ff->lookup[fields[n]];
+        if ((lookup->packing / 10) % 10 == FF_COMPRESS_MASK) compressed = 1;
+        if (lookup->stash_code == FF_LAND_SEA_MASK &&
+            lookup->packing == 0) has_mask = 1;
+    }
+    if (compressed && !has_mask){
+        int mask = -1;
+        for (size_t i=0;i<ff->header->field_count && mask < 0;++i){
+            if (ff->lookup[i].stash_code == FF_LAND_SEA_MASK &&
+                ff->lookup[i].packing == 0) mask = i;
+        }
+        if (mask < 0){
+            fprintf(stderr, "Warning: compressed fields are selected but the "
+                            "file has no land-sea mask\n");
+        } else {
+            // Keep the fields in file order
+            size_t n = count++;
+            while (n > 0 && fields[n-1] > mask){
+                fields[n] = fields[n-1];
+                --n;
+            }
+            fields[n] = mask;
+        }
+    }
+
+    WriteFieldsFileSubset(ff,args.output,fields,count);
+
+    free(fields);
+    free(args.stash);
+    CloseFieldsFile(ff);
+}
@@ -0,0 +1,333 @@
+/*
+ * \file    zarr.c
+ * \author  Scott Wales (scott.wales@unimelb.edu.au)
+ * \brief   Writer for Zarr chunked array stores
+ *
+ * Copyright 2013 ARC Centre of Excellence for Climate System Science
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "zarr.h"
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define ZARR_MAX_DIMS 8
+
+struct zarr {
+    char * path;
+    int ndims;
+    size_t chunks[ZARR_MAX_DIMS];
+    size_t chunk_size;
+};
+
+// Files are written under a temporary name, then renamed into place by
+// close_atomic() so that they appear all at once
+FILE * open_atomic(const char * path, char ** tmp){
+    asprintf(tmp,"%s.tmp%lx",path,(unsigned long)pthread_self());
+    FILE * f = fopen(*tmp,"w");
+    if (!f){
+        perror(*tmp);
+        exit(-1);
+    }
+    return f;
+}
+void close_atomic(FILE * f, const char * path, char * tmp){
+    if (fclose(f) != 0){
+        perror(tmp);
+        exit(-1);
+    }
+    if (rename(tmp,path) != 0){
+        perror(path);
+        exit(-1);
+    }
+    free(tmp);
+}
+void write_atomic(const char * path, const void * data, size_t size){
+    char * tmp = NULL;
+    FILE * f = open_atomic(path,&tmp);
+    if (fwrite(data,1,size,f) != size){
+        perror(tmp);
+        exit(-1);
+    }
+    close_atomic(f,path,tmp);
+}
+
+void make_dir(const char * path){
+    if (mkdir(path,0777) != 0 && errno != EEXIST){
+        perror(path);
+        exit(-1);
+    }
+}
+
+// Remove the files of an existing array, so chunks from an earlier run don't
+// show through where this run writes none
+void clear_dir(const char * path){
+    DIR * dir = opendir(path);
+    if (!dir){
+        perror(path);
+        exit(-1);
+    }
+    struct dirent * entry;
+    while ((entry = readdir(dir))){
+        if (strcmp(entry->d_name,".") == 0 ||
+            strcmp(entry->d_name,"..") == 0) continue;
+        if (unlinkat(dirfd(dir),entry->d_name,0) != 0){
+            // Arrays hold no subdirectories, so this isn't one of ours
+            fprintf(stderr,"%s/%s: %s\n",path,entry->d_name,strerror(errno));
+            exit(-1);
+        }
+    }
+    closedir(dir);
+}
+
+struct zarr * ZarrCreate(const char * path,
+                         const char * name,
+                         int ndims,
+                         const size_t * shape,
+                         const size_t * chunks,
+                         const char * const * dims){
+    assert(ndims > 0 && ndims <= ZARR_MAX_DIMS);
+
+    char * file = NULL;
+    const char * group = "{\n    \"zarr_format\": 2\n}\n";
+    make_dir(path);
+    asprintf(&file,"%s/.zgroup",path);
+    write_atomic(file,group,strlen(group));
+    free(file);
+
+    struct zarr * this = malloc(sizeof(*this));
+    asprintf(&this->path,"%s/%s",path,name);
+    this->ndims = ndims;
+    this->chunk_size = 1;
+    for (int d=0;d<ndims;++d){
+        this->chunks[d] = chunks[d];
+        this->chunk_size *= chunks[d];
+    }
+    make_dir(this->path);
+    clear_dir(this->path);
+
+    // Array metadata
+    char * json = NULL;
+    size_t size = 0;
+    FILE * out = open_memstream(&json,&size);
+    fprintf(out,"{\n    \"zarr_format\": 2,\n    \"shape\": [");
+    for (int d=0;d<ndims;++d) fprintf(out,"%s%zu",d ? ", " : "",shape[d]);
+    fprintf(out,"],\n    \"chunks\": [");
+    for (int d=0;d<ndims;++d) fprintf(out,"%s%zu",d ? ", " : "",chunks[d]);
+    fprintf(out,"],\n"
+                "    \"dtype\": \"<f8\",\n"
+                "    \"compressor\": {\"id\": \"zlib\", \"level\": 1},\n"
+                "    \"fill_value\": \"NaN\",\n"
+                "    \"order\": \"C\",\n"
+                "    \"filters\": null,\n"
+                "    \"dimension_separator\": \".\"\n"
+                "}\n");
+    fclose(out);
+    asprintf(&file,"%s/.zarray",this->path);
+    write_atomic(file,json,size);
+    free(file);
+    free(json);
+
+    // Dimension names, as used by xarray
+    out = open_memstream(&json,&size);
+    fprintf(out,"{\n    \"_ARRAY_DIMENSIONS\": [");
+    for (int d=0;d<ndims;++d) fprintf(out,"%s\"%s\"",d ? ", " : "",dims[d]);
+    fprintf(out,"]\n}\n");
+    fclose(out);
+    asprintf(&file,"%s/.zattrs",this->path);
+    write_atomic(file,json,size);
+    free(file);
+    free(json);
+
+    return this;
+}
+
+void ZarrWriteChunk(const struct zarr * this,
+                    const size_t * chunk,
+                    const double * data){
+    // Chunk files are named by their index, e.g. '0.3.1'
+    char * file = NULL;
+    size_t length = 0;
+    FILE * name = open_memstream(&file,&length);
+    fprintf(name,"%s/",this->path);
+    for (int d=0;d<this->ndims;++d) fprintf(name,"%s%zu",d ? "." : "",chunk[d]);
+    fclose(name);
+
+    char * tmp = NULL;
+    FILE * f = open_atomic(file,&tmp);
+
+    // Compress through a fixed size buffer, so memory use doesn't depend on
+    // the size of the chunk
+    unsigned char buffer[ZARR_WRITE_BUFFER];
+    z_stream stream = {
+        .next_in = (Bytef *)data,
+        .avail_in = this->chunk_size*sizeof(*data),
+    };
+    int err = deflateInit2(&stream,1,Z_DEFLATED,15,8,Z_DEFAULT_STRATEGY);
+    while (err == Z_OK){
+        stream.next_out = buffer;
+        stream.avail_out = sizeof(buffer);
+        err = deflate(&stream,Z_FINISH);
+        size_t n = sizeof(buffer) - stream.avail_out;
+        if (fwrite(buffer,1,n,f) != n){
+            perror(tmp);
+            exit(-1);
+        }
+    }
+    deflateEnd(&stream);
+    if (err != Z_STREAM_END){
+        fprintf(stderr,"%s: zlib error %d\n",file,err);
+        exit(-1);
+    }
+
+    close_atomic(f,file,tmp);
+    free(file);
+}
+
+void ZarrFree(struct zarr * this){
+    if (this){
+        free(this->path);
+    }
+    free(this);
+}
+
+// A chunk waiting to be written
+struct job {
+    double * buffer;
+    size_t chunk[ZARR_MAX_DIMS];
+};
+
+// Buffers cycle between the free list and the job queue. Both have room for
+// every buffer, so neither can overflow.
+struct zarrwriter {
+    const struct zarr * array;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    double ** free;
+    size_t nfree;
+
+    struct job * jobs;
+    size_t capacity;
+    size_t head;
+    size_t njobs;
+    int done;
+
+    int nthreads;
+    pthread_t * threads;
+};
+
+void * writer_thread(void * arg){
+    struct zarrwriter * this = arg;
+    pthread_mutex_lock(&this->lock);
+    while (1){
+        while (this->njobs == 0 && !this->done){
+            pthread_cond_wait(&this->changed,&this->lock);
+        }
+        if (this->njobs == 0) break;
+
+        struct job job = this->jobs[this->head];
+        this->head = (this->head+1) % this->capacity;
+        this->njobs--;
+
+        // Compress & write without holding the lock
+        pthread_mutex_unlock(&this->lock);
+        ZarrWriteChunk(this->array,job.chunk,job.buffer);
+        pthread_mutex_lock(&this->lock);
+
+        this->free[this->nfree++] = job.buffer;
+        pthread_cond_broadcast(&this->changed);
+    }
+    pthread_mutex_unlock(&this->lock);
+    return NULL;
+}
+
+struct zarrwriter * ZarrWriterStart(const struct zarr * array,
+                                    int threads,
+                                    double ** buffers,
+                                    size_t count){
+    assert(threads > 0 && count > 0);
+
+    struct zarrwriter * this = calloc(1,sizeof(*this));
+    this->array = array;
+    pthread_mutex_init(&this->lock,NULL);
+    pthread_cond_init(&this->changed,NULL);
+
+    this->free = malloc(count*sizeof(*(this->free)));
+    memcpy(this->free,buffers,count*sizeof(*(this->free)));
+    this->nfree = count;
+    this->jobs = malloc(count*sizeof(*(this->jobs)));
+    this->capacity = count;
+
+    this->nthreads = threads;
+    this->threads = malloc(threads*sizeof(*(this->threads)));
+    for (int t=0;t<threads;++t){
+        int err = pthread_create(&this->threads[t],NULL,writer_thread,this);
+        if (err != 0){
+            errno = err;
+            perror("ZarrWriterStart");
+            exit(-1);
+        }
+    }
+    return this;
+}
+
+double * ZarrWriterBuffer(struct zarrwriter * this){
+    pthread_mutex_lock(&this->lock);
+    while (this->nfree == 0){
+        pthread_cond_wait(&this->changed,&this->lock);
+    }
+    double * buffer = this->free[--this->nfree];
+    pthread_mutex_unlock(&this->lock);
+    return buffer;
+}
+
+void ZarrWriterSubmit(struct zarrwriter * this,
+                      double * buffer,
+                      const size_t * chunk){
+    pthread_mutex_lock(&this->lock);
+    struct job * job = &this->jobs[(this->head+this->njobs) % this->capacity];
+    job->buffer = buffer;
+    memcpy(job->chunk,chunk,this->array->ndims*sizeof(*chunk));
+    this->njobs++;
+    pthread_cond_broadcast(&this->changed);
+    pthread_mutex_unlock(&this->lock);
+}
+
+void ZarrWriterFinish(struct zarrwriter * this){
+    pthread_mutex_lock(&this->lock);
+    this->done = 1;
+    pthread_cond_broadcast(&this->changed);
+    pthread_mutex_unlock(&this->lock);
+
+    for (int t=0;t<this->nthreads;++t){
+        pthread_join(this->threads[t],NULL);
+    }
+
+    pthread_mutex_destroy(&this->lock);
+    pthread_cond_destroy(&this->changed);
+    free(this->threads);
+    free(this->jobs);
+    free(this->free);
+    free(this);
+}
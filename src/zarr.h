@@ -0,0 +1,123 @@
+/**
+ * \file    zarr.h
+ * \author  Scott Wales (scott.wales@unimelb.edu.au)
+ * \brief   Writer for Zarr chunked array stores
+ *
+ * A Zarr (version 2) store is a directory holding one subdirectory per
+ * variable. Each variable has JSON metadata describing its shape and chunking,
+ * and each chunk of the array is stored zlib compressed in its own file. Chunks
+ * that haven't been written yet read as missing values, so a store can be
+ * opened while it is still being written.
+ *
+ * Chunks are written to a temporary file and renamed into place, so readers
+ * never see a partly written chunk. Dimension names are stored in the
+ * `_ARRAY_DIMENSIONS` attribute used by xarray.
+ *
+ * Copyright 2013 ARC Centre of Excellence for Climate System Science
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ZARR_H
+#define ZARR_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/** @defgroup zarr
+ *  @{
+ */
+
+struct zarr;
+struct zarrwriter;
+
+/// Size of the buffer chunks are compressed through
+#define ZARR_WRITE_BUFFER (64*1024)
+
+/**
+ * Memory used by a single ZarrWriteChunk() call on top of the chunk itself,
+ * the compression buffer and zlib's state at compression level 1
+ */
+#define ZARR_WRITE_MEMORY (ZARR_WRITE_BUFFER + 300*1024)
+
+/**
+ * @brief Creates a double precision array in the store at \p path
+ *
+ * The store directory is created if needed, an existing array of the same
+ * name is replaced, removing all of its chunks. \p shape, \p chunks and
+ * \p dims each hold \p ndims values, the array is split into chunks of shape
+ * \p chunks. If an error occurs the function will call perror() and exit(-1).
+ */
+struct zarr * ZarrCreate(const char * path,
+                         const char * name,
+                         int ndims,
+                         const size_t * shape,
+                         const size_t * chunks,
+                         const char * const * dims);
+
+/**
+ * @brief Writes a single chunk of the array
+ *
+ * \p chunk holds the index of the chunk along each dimension, \p data holds
+ * the chunk's values in C order. Safe to call from multiple threads at once,
+ * each call uses at most ZARR_WRITE_MEMORY bytes however big the chunk is.
+ */
+void ZarrWriteChunk(const struct zarr * array,
+                    const size_t * chunk,
+                    const double * data);
+
+/**
+ * @brief Frees the array handle
+ */
+void ZarrFree(struct zarr * array);
+
+/**
+ * @brief Starts \p threads threads writing chunks of \p array
+ *
+ * Chunks are passed to the threads in the \p count buffers given, each
+ * holding a single chunk. The buffers remain owned by the caller.
+ */
+struct zarrwriter * ZarrWriterStart(const struct zarr * array,
+                                    int threads,
+                                    double ** buffers,
+                                    size_t count);
+
+/**
+ * @brief Returns a free chunk buffer
+ *
+ * Waits for the threads to finish with a buffer if all are in use
+ */
+double * ZarrWriterBuffer(struct zarrwriter * writer);
+
+/**
+ * @brief Queues a buffer from ZarrWriterBuffer() to be written as \p chunk
+ */
+void ZarrWriterSubmit(struct zarrwriter * writer,
+                      double * buffer,
+                      const size_t * chunk);
+
+/**
+ * @brief Waits for all queued chunks to be written and stops the threads
+ */
+void ZarrWriterFinish(struct zarrwriter * writer);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+#endif